@@ -0,0 +1,260 @@
+/*
+ * access_log.c: The access log, with a line per request:
+ *
+ *   time path status bytes source latency
+ *
+ * e.g., "2024-01-31T12:00:00.123Z ./fileset_dir/00001 200 8410 hit 212",
+ * where the source is one of hit, cold, miss, spill, bundle or "-", and the
+ * latency is in microseconds, from accept until the response is sent.
+ *
+ * Workers don't write the log themselves. Each worker puts its records in a
+ * ring of its own, without locks, and a background thread drains the rings
+ * and writes the lines out in large batches. A ring is allocated when a
+ * worker first needs one, and is passed on to a later worker when it exits.
+ * When a ring is full, the record is dropped and counted (see stats.c), so a
+ * slow disk never holds up the workers.
+ */
+
+#include "common.h"
+#include "stats.h"
+#include "access_log.h"
+
+/* records per ring, a power of two */
+#define ACCESS_RING_SIZE 1024
+#define ACCESS_PATH_MAX 240
+/* how long the writer sleeps when the rings are empty, in ms */
+#define ACCESS_LOG_INTERVAL 10
+#define ACCESS_BATCH_SIZE (64 * 1024)
+
+struct access_record {
+	long time;		/* wall clock, in ns */
+	long latency;		/* in ns */
+	long bytes_sent;
+	int status;
+	enum access_source source;
+	char path[ACCESS_PATH_MAX];
+};
+
+/* a ring with a single producer, the worker, and a single consumer, the
+ * writer. head is only written by the producer and tail by the consumer */
+struct access_ring {
+	unsigned long head __attribute__((aligned(64)));
+	unsigned long tail __attribute__((aligned(64)));
+	int owned;		/* by a worker */
+	struct access_record records[ACCESS_RING_SIZE];
+};
+
+static char *access_sources[] = {
+	[ACCESS_NONE] = "-",
+	[ACCESS_HIT] = "hit",
+	[ACCESS_COLD] = "cold",
+	[ACCESS_MISS] = "miss",
+	[ACCESS_SPILL] = "spill",
+	[ACCESS_BUNDLE] = "bundle",
+};
+
+static int access_fd = -1;
+/* the rings, which are NULL until they are needed */
+static struct access_ring **access_rings = NULL;
+static int access_nr_rings = 0;
+static pthread_mutex_t access_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static int access_exiting = 0;
+static pthread_t access_thread;
+/* the ring of this thread, or NULL if it has none */
+static __thread struct access_ring *access_ring = NULL;
+
+/* formats the records in ring into buf, which has room for max bytes.
+ * Returns the number of bytes used */
+static int
+access_drain(struct access_ring *ring, char *buf, int max)
+{
+	unsigned long head, tail;
+	struct access_record *r;
+	struct tm tm;
+	time_t secs;
+	char date[32];
+	int size = 0, n;
+
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	for (tail = ring->tail; tail != head; tail++) {
+		r = &ring->records[tail & (ACCESS_RING_SIZE - 1)];
+		secs = r->time / 1000000000L;
+		gmtime_r(&secs, &tm);
+		strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", &tm);
+		n = snprintf(buf + size, max - size, "%s.%03ldZ %s %d %ld %s "
+			     "%ld\n", date, r->time / 1000000 % 1000, r->path,
+			     r->status, r->bytes_sent,
+			     access_sources[r->source], r->latency / 1000);
+		if (n >= max - size) {
+			/* no room, the rest goes in the next batch */
+			break;
+		}
+		size += n;
+	}
+	__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+	return size;
+}
+
+static void *
+access_writer(void *arg)
+{
+	char *buf = Malloc(ACCESS_BATCH_SIZE);
+	int exiting, size, i, n;
+
+	do {
+		exiting = __atomic_load_n(&access_exiting, __ATOMIC_ACQUIRE);
+		size = 0;
+		for (i = 0; i < access_nr_rings; i++) {
+			struct access_ring *ring =
+				__atomic_load_n(&access_rings[i],
+						__ATOMIC_ACQUIRE);
+
+			if (ring == NULL)
+				continue;
+			while ((n = access_drain(ring, buf + size,
+						 ACCESS_BATCH_SIZE - size))
+			       > 0) {
+				size += n;
+				if (ACCESS_BATCH_SIZE - size < 1024) {
+					Rio_write(access_fd, buf, size);
+					size = 0;
+				}
+			}
+		}
+		if (size > 0) {
+			Rio_write(access_fd, buf, size);
+		} else if (!exiting) {
+			usleep(ACCESS_LOG_INTERVAL * 1000);
+		}
+		/* after the exit flag is seen, the rings are drained once
+		 * more, since workers are done by then */
+	} while (!exiting || size > 0);
+	free(buf);
+	return NULL;
+}
+
+static struct access_ring *
+access_ring_alloc(void)
+{
+	struct access_ring *ring = Malloc(sizeof(struct access_ring));
+
+	memset(ring, 0, sizeof(struct access_ring));
+	ring->owned = 1;
+	return ring;
+}
+
+/* opens the access log at path, with rings for the main thread and up to
+ * max_threads workers, and starts the writer.
+ * Returns 1 on success, 0 if there is no access log. */
+int
+access_log_init(char *path, int max_threads)
+{
+	if (path == NULL)
+		return 0;
+	if ((access_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0) {
+		fprintf(stderr, "access log: %s: %s\n", path, strerror(errno));
+		return 0;
+	}
+	access_nr_rings = max_threads + 1;
+	access_rings = Malloc(sizeof(struct access_ring *) * access_nr_rings);
+	memset(access_rings, 0, sizeof(struct access_ring *) * access_nr_rings);
+	/* the first ring is the main thread's */
+	access_rings[0] = access_ring = access_ring_alloc();
+	access_exiting = 0;
+	pthread_create(&access_thread, NULL, access_writer, NULL);
+	return 1;
+}
+
+/* gives the calling worker thread a ring of its own. a ring can't be
+ * shared, since it has a single producer, so when there are none left, the
+ * records of the thread are dropped */
+void
+access_log_thread(void)
+{
+	int i;
+
+	if (access_fd < 0)
+		return;
+	pthread_mutex_lock(&access_rings_lock);
+	for (i = 1; i < access_nr_rings; i++) {
+		if (access_rings[i] == NULL) {
+			access_ring = access_ring_alloc();
+			__atomic_store_n(&access_rings[i], access_ring,
+					 __ATOMIC_RELEASE);
+			break;
+		}
+		if (!access_rings[i]->owned) {
+			access_ring = access_rings[i];
+			access_ring->owned = 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&access_rings_lock);
+}
+
+/* passes the ring of the calling worker thread, which is exiting, on */
+void
+access_log_thread_exit(void)
+{
+	if (access_ring == NULL)
+		return;
+	pthread_mutex_lock(&access_rings_lock);
+	access_ring->owned = 0;
+	pthread_mutex_unlock(&access_rings_lock);
+	access_ring = NULL;
+}
+
+void
+access_log(char *file_name, int status, long bytes_sent,
+	   enum access_source source, long latency)
+{
+	struct access_ring *ring;
+	struct access_record *r;
+	struct timespec ts;
+	unsigned long head;
+
+	if (access_fd < 0)
+		return;
+	if ((ring = access_ring) == NULL) {
+		stats_add(STATS_LOG_DROPS, 1);
+		return;
+	}
+	head = ring->head;
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) ==
+	    ACCESS_RING_SIZE) {
+		/* the writer can't keep up */
+		stats_add(STATS_LOG_DROPS, 1);
+		return;
+	}
+	r = &ring->records[head & (ACCESS_RING_SIZE - 1)];
+	clock_gettime(CLOCK_REALTIME, &ts);
+	r->time = ts.tv_sec * 1000000000L + ts.tv_nsec;
+	r->latency = latency;
+	r->bytes_sent = bytes_sent;
+	r->status = status;
+	r->source = source;
+	snprintf(r->path, sizeof(r->path), "%s", file_name);
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* writes out the records that are left, and closes the log. the workers
+ * must have exited */
+void
+access_log_exit(void)
+{
+	int i;
+
+	if (access_fd < 0)
+		return;
+	__atomic_store_n(&access_exiting, 1, __ATOMIC_RELEASE);
+	pthread_join(access_thread, NULL);
+	SYS(close(access_fd));
+	access_fd = -1;
+	for (i = 0; i < access_nr_rings; i++) {
+		free(access_rings[i]);
+	}
+	free(access_rings);
+	access_rings = NULL;
+	access_ring = NULL;
+	access_nr_rings = 0;
+}
@@ -0,0 +1,21 @@
+#ifndef __ACCESS_LOG_H__
+#define __ACCESS_LOG_H__
+
+/* where the file of a request came from */
+enum access_source {
+	ACCESS_NONE,	/* not served from a file, e.g., an error */
+	ACCESS_HIT,	/* the cache */
+	ACCESS_COLD,	/* the cold tier of the cache */
+	ACCESS_MISS,	/* the document root */
+	ACCESS_SPILL,	/* the spill file */
+	ACCESS_BUNDLE,	/* the bundle, see bundle.c */
+};
+
+int access_log_init(char *path, int max_threads);
+void access_log_thread(void);
+void access_log_thread_exit(void);
+void access_log(char *file_name, int status, long bytes_sent,
+		enum access_source source, long latency);
+void access_log_exit(void);
+
+#endif /* __ACCESS_LOG_H__ */
@@ -0,0 +1,182 @@
+/*
+ * admit.c: Admission of files to the cache, after TinyLFU.
+ *
+ * Every request for a file is counted in a count-min sketch, a few rows of
+ * small counters that a file is hashed into, one counter per row. The
+ * smallest of its counters is an estimate of how often the file was
+ * requested, which is never too low. A file that doesn't fit in the cache
+ * is only admitted if it was requested more often than the file it would
+ * evict, so files that are requested once, e.g., by a scan, don't push out
+ * the files that keep being requested.
+ *
+ * The counters are halved every ADMIT_SAMPLE requests per counter of a row,
+ * so the estimates follow what is requested now. A doorkeeper, a Bloom
+ * filter that is cleared along with the halving, optionally takes the
+ * first request for each file, so files requested once don't take up the
+ * counters at all.
+ *
+ * The cache lock (see server_thread.c) protects the sketch.
+ */
+
+#include "common.h"
+#include "admit.h"
+
+#define ADMIT_ROWS 4
+/* requests per counter of a row between two halvings */
+#define ADMIT_SAMPLE 10
+/* counters saturate at this */
+#define ADMIT_MAX 15
+/* bits of the doorkeeper per counter of a row, and bits set per file */
+#define ADMIT_DOOR_BITS 8
+#define ADMIT_DOOR_HASHES 3
+
+static unsigned char *admit_counters = NULL;	/* ADMIT_ROWS rows */
+static unsigned long admit_width;		/* counters per row, a power of two */
+static unsigned long admit_requests;		/* since the last halving */
+static unsigned long *admit_door = NULL;	/* the doorkeeper, or NULL */
+static unsigned long admit_door_size;		/* bits, a power of two */
+
+/* FNV-1a of the file name and block, with a final mix so that the high
+ * half, from which the other hashes are made, is as good as the low half */
+static unsigned long long
+admit_hash(char *name, long block)
+{
+	unsigned long long h = 14695981039346656037ull;
+
+	for (; *name; name++)
+		h = (h ^ (unsigned char)*name) * 1099511628211ull;
+	h = (h ^ (unsigned long long)block) * 1099511628211ull;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+	return h;
+}
+
+/* the i'th of the hashes of a file, by double hashing */
+static unsigned long
+admit_index(unsigned long long h, int i, unsigned long size)
+{
+	return (unsigned long)((h & 0xffffffff) + i * (h >> 32)) & (size - 1);
+}
+
+/* Returns 1 if the doorkeeper has seen the file, and remembers it */
+static int
+admit_door_add(unsigned long long h)
+{
+	unsigned long bit;
+	int seen = 1;
+	int i;
+
+	for (i = 0; i < ADMIT_DOOR_HASHES; i++) {
+		bit = admit_index(h, i + ADMIT_ROWS, admit_door_size);
+		if (!(admit_door[bit / 64] & (1ul << (bit % 64)))) {
+			admit_door[bit / 64] |= 1ul << (bit % 64);
+			seen = 0;
+		}
+	}
+	return seen;
+}
+
+static int
+admit_door_has(unsigned long long h)
+{
+	unsigned long bit;
+	int i;
+
+	for (i = 0; i < ADMIT_DOOR_HASHES; i++) {
+		bit = admit_index(h, i + ADMIT_ROWS, admit_door_size);
+		if (!(admit_door[bit / 64] & (1ul << (bit % 64))))
+			return 0;
+	}
+	return 1;
+}
+
+/* halves the counters and clears the doorkeeper */
+static void
+admit_age(void)
+{
+	unsigned long i;
+
+	for (i = 0; i < ADMIT_ROWS * admit_width; i++)
+		admit_counters[i] >>= 1;
+	if (admit_door != NULL)
+		memset(admit_door, 0, admit_door_size / 8);
+	admit_requests = 0;
+}
+
+/* counts requests for about nr_files files, through a doorkeeper if
+ * doorkeeper is set */
+void
+admit_init(int nr_files, int doorkeeper)
+{
+	admit_width = 1024;
+	while (admit_width < (unsigned long)nr_files)
+		admit_width *= 2;
+	admit_counters = Malloc(ADMIT_ROWS * admit_width);
+	memset(admit_counters, 0, ADMIT_ROWS * admit_width);
+	admit_requests = 0;
+	if (doorkeeper) {
+		admit_door_size = admit_width * ADMIT_DOOR_BITS;
+		admit_door = Malloc(admit_door_size / 8);
+		memset(admit_door, 0, admit_door_size / 8);
+	}
+}
+
+int
+admit_enabled(void)
+{
+	return admit_counters != NULL;
+}
+
+/* counts a request for a block of a file */
+void
+admit_record(char *name, long block)
+{
+	unsigned long long h;
+	unsigned char *counter;
+	int i;
+
+	if (admit_counters == NULL)
+		return;
+	h = admit_hash(name, block);
+	if (++admit_requests >= ADMIT_SAMPLE * admit_width)
+		admit_age();
+	if (admit_door != NULL && !admit_door_add(h))
+		return;
+	for (i = 0; i < ADMIT_ROWS; i++) {
+		counter = &admit_counters[i * admit_width +
+					  admit_index(h, i, admit_width)];
+		if (*counter < ADMIT_MAX)
+			(*counter)++;
+	}
+}
+
+/* Returns how often a block of a file was requested, lately */
+int
+admit_estimate(char *name, long block)
+{
+	unsigned long long h;
+	int i, count, min = ADMIT_MAX;
+
+	if (admit_counters == NULL)
+		return 0;
+	h = admit_hash(name, block);
+	for (i = 0; i < ADMIT_ROWS; i++) {
+		count = admit_counters[i * admit_width +
+				       admit_index(h, i, admit_width)];
+		if (count < min)
+			min = count;
+	}
+	if (admit_door != NULL && admit_door_has(h))
+		min++;
+	return min;
+}
+
+void
+admit_exit(void)
+{
+	free(admit_counters);
+	admit_counters = NULL;
+	free(admit_door);
+	admit_door = NULL;
+}
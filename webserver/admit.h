@@ -0,0 +1,10 @@
+#ifndef __ADMIT_H__
+#define __ADMIT_H__
+
+void admit_init(int nr_files, int doorkeeper);
+int admit_enabled(void);
+void admit_record(char *name, long block);
+int admit_estimate(char *name, long block);
+void admit_exit(void);
+
+#endif /* __ADMIT_H__ */
@@ -0,0 +1,431 @@
+/*
+ * bundle.c: A document root packed into a single file, which the server maps
+ * and serves files from, without a system call per file.
+ *
+ * Bundles are packed offline, by "fileset -b", see bundle_pack. A bundle
+ * starts with a bundle_header, which takes the first page, followed by the
+ * bodies of the files, each starting on a page of its own, and then by the
+ * index. The index is a perfect hash of the names of the files, made by hash
+ * and displace: the hash of a name picks a bucket, and the displacement of
+ * the bucket is the seed of a second hash, which picks the slot of the name.
+ * Displacements are chosen when the bundle is packed, so that no two names
+ * share a slot, and a lookup reads a single slot. The names, the headers of
+ * the responses and the 304 responses of the files come last, formatted by
+ * the packer just as the server would format them.
+ *
+ * The files are served as they were when they were packed, the document
+ * root is not checked again.
+ */
+
+#define _GNU_SOURCE	/* for nftw */
+#include <ftw.h>
+#include <limits.h>
+#include <stdint.h>
+#include "common.h"
+#include "request.h"
+#include "bundle.h"
+
+#define BUNDLE_MAGIC "OSBUNDL1"
+#define BUNDLE_PAGE 4096
+/* names per bucket of the perfect hash, on average */
+#define BUNDLE_BUCKET_SIZE 4
+/* displacements tried for a bucket, before packing gives up */
+#define BUNDLE_MAX_TRIES (1 << 24)
+
+struct bundle_header {
+	char magic[8];
+	uint32_t nr_files;
+	uint32_t nr_buckets;
+	uint32_t nr_slots;
+	uint32_t unused;
+	uint64_t index_offset;	/* of the displacements, then the slots */
+	uint64_t size;		/* of the bundle */
+};
+
+/* a slot of the perfect hash. offsets are from the start of the bundle */
+struct bundle_entry {
+	uint64_t name_offset;
+	uint64_t header_offset;	/* of the header of the 200 response */
+	uint64_t response_304_offset;
+	uint64_t body_offset;	/* page aligned */
+	uint32_t name_size;	/* 0 for an empty slot */
+	uint32_t header_size;
+	uint32_t response_304_size;
+	uint32_t body_size;
+	uint32_t csum;
+	uint32_t unused;
+	int64_t mtime;
+	char etag[32];
+};
+
+/* a file that is being packed */
+struct bundle_file {
+	char *name;
+	char *header;
+	char *response_304;
+	uint32_t bucket;
+	struct bundle_entry entry;
+};
+
+/* the bundle that is being packed, see bundle_pack */
+static struct bundle_file *pack_files = NULL;
+static int pack_nr_files = 0;
+static int *pack_bucket_sizes = NULL;
+static int pack_fd = -1;
+static uint64_t pack_offset;	/* where the next body goes */
+
+/* the bundle that is being served */
+static char *bundle_map = NULL;
+static struct bundle_header *bundle_header;
+static uint32_t *bundle_displacements;
+static struct bundle_entry *bundle_slots;
+
+/* FNV-1a, with the seed mixed in first, and the bits mixed once more at the
+ * end, so that seeds that are close give unrelated hashes */
+static uint64_t
+bundle_hash(const char *name, size_t size, uint64_t seed)
+{
+	uint64_t h = 14695981039346656037ULL ^ (seed * 0x9e3779b97f4a7c15ULL);
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		h ^= (unsigned char)name[i];
+		h *= 1099511628211ULL;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static void
+bundle_write(uint64_t offset, const void *buf, size_t size)
+{
+	ssize_t n;
+
+	while (size > 0) {
+		SYS(n = pwrite(pack_fd, buf, size, offset));
+		buf = (const char *)buf + n;
+		offset += n;
+		size -= n;
+	}
+}
+
+/* reads in a file found by bundle_pack, writes its body out, and keeps the
+ * rest for the index */
+static int
+bundle_pack_file(const char *path, const struct stat *sbuf, int type,
+		 struct FTW *ftw)
+{
+	struct bundle_file *file;
+	struct file_meta meta;
+	struct file_data data;
+	char buf[MAXBUF];
+	int size;
+
+	if (type != FTW_F)
+		return 0;
+	while (strncmp(path, "./", 2) == 0)
+		path += 2;
+	memset(&data, 0, sizeof(data));
+	data.file_name = Malloc(MAXLINE);
+	/* named like request_init names them */
+	request_parse_URI((char *)path, data.file_name, MAXLINE);
+	/* files that the server doesn't serve, e.g., C files, are left out */
+	if (!request_checkfile(data.file_name, &meta) || meta.size > INT_MAX) {
+		free(meta.error);
+		free(data.file_name);
+		return 0;
+	}
+	data.file_size = meta.size;
+	data.file_mtime = meta.mtime;
+	if (!request_loaddata(&data, 1)) {
+		/* removed since it was found */
+		free(data.file_name);
+		free(data.file_buf);
+		return 0;
+	}
+	size = request_format_header(&data, buf);
+
+	pack_files = Realloc(pack_files, sizeof(struct bundle_file) *
+			     (pack_nr_files + 1));
+	file = &pack_files[pack_nr_files++];
+	memset(file, 0, sizeof(*file));
+	file->name = data.file_name;
+	file->header = Malloc(size);
+	memcpy(file->header, buf, size);
+	file->response_304 = data.file_304;
+	file->entry.name_size = strlen(data.file_name);
+	file->entry.header_size = size;
+	file->entry.response_304_size = data.file_304_size;
+	file->entry.body_offset = pack_offset;
+	file->entry.body_size = data.file_size;
+	file->entry.csum = data.file_csum;
+	file->entry.mtime = data.file_mtime;
+	memcpy(file->entry.etag, data.file_etag, sizeof(file->entry.etag));
+
+	bundle_write(pack_offset, data.file_buf, data.file_size);
+	pack_offset += (data.file_size + BUNDLE_PAGE - 1) / BUNDLE_PAGE *
+		BUNDLE_PAGE;
+	free(data.file_buf);
+	return 0;
+}
+
+/* the largest buckets come first */
+static int
+bundle_compare(const void *a, const void *b)
+{
+	const struct bundle_file *x = &pack_files[*(const int *)a];
+	const struct bundle_file *y = &pack_files[*(const int *)b];
+
+	if (pack_bucket_sizes[x->bucket] != pack_bucket_sizes[y->bucket])
+		return pack_bucket_sizes[y->bucket] -
+			pack_bucket_sizes[x->bucket];
+	return (x->bucket > y->bucket) - (x->bucket < y->bucket);
+}
+
+static uint32_t
+bundle_slot(struct bundle_file *file, uint32_t displacement,
+	    uint32_t nr_slots)
+{
+	return bundle_hash(file->name, file->entry.name_size, displacement) %
+		nr_slots;
+}
+
+/* finds the displacement of each bucket, so that every file gets a slot of
+ * its own, and fills slot_files with the file in each slot, or -1.
+ * Returns 1 on success, 0 if no displacements were found */
+static int
+bundle_hash_files(struct bundle_header *header, uint32_t *displacements,
+		  int *slot_files)
+{
+	uint32_t bucket, d;
+	int *order;
+	int i, j, k, m, ret = 1;
+
+	pack_bucket_sizes = Malloc(sizeof(int) * header->nr_buckets);
+	memset(pack_bucket_sizes, 0, sizeof(int) * header->nr_buckets);
+	order = Malloc(sizeof(int) * (pack_nr_files + 1));
+	for (i = 0; i < pack_nr_files; i++) {
+		struct bundle_file *file = &pack_files[i];
+
+		file->bucket = bundle_hash(file->name, file->entry.name_size,
+					   0) % header->nr_buckets;
+		pack_bucket_sizes[file->bucket]++;
+		order[i] = i;
+	}
+	/* the largest buckets are placed while most slots are still free */
+	qsort(order, pack_nr_files, sizeof(int), bundle_compare);
+	for (i = 0; i < header->nr_slots; i++)
+		slot_files[i] = -1;
+	for (i = 0; i < pack_nr_files && ret; i = j) {
+		bucket = pack_files[order[i]].bucket;
+		for (j = i; j < pack_nr_files &&
+			     pack_files[order[j]].bucket == bucket; j++)
+			;
+		for (d = 1; d < BUNDLE_MAX_TRIES; d++) {
+			for (k = i; k < j; k++) {
+				uint32_t slot = bundle_slot(&pack_files[order[k]],
+							    d, header->nr_slots);
+
+				if (slot_files[slot] >= 0)
+					break;
+				slot_files[slot] = order[k];
+			}
+			if (k == j)
+				break;
+			/* give back the slots taken with this displacement */
+			for (m = i; m < k; m++) {
+				slot_files[bundle_slot(&pack_files[order[m]], d,
+						       header->nr_slots)] = -1;
+			}
+		}
+		displacements[bucket] = d;
+		ret = d < BUNDLE_MAX_TRIES;
+	}
+	free(order);
+	free(pack_bucket_sizes);
+	pack_bucket_sizes = NULL;
+	return ret;
+}
+
+/* packs the files below dir into a bundle at path. the names of the files
+ * are relative to the current directory, which should be the document root
+ * of the server.
+ * Returns the number of files packed, or -1 on failure. */
+int
+bundle_pack(char *dir, char *path)
+{
+	struct bundle_header header;
+	struct bundle_entry *slots;
+	uint32_t *displacements;
+	int *slot_files;
+	uint64_t offset;
+	int i, ret = -1;
+
+	SYS(pack_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644));
+	/* the header takes the first page */
+	pack_offset = BUNDLE_PAGE;
+	if (nftw(dir, bundle_pack_file, 16, FTW_PHYS) < 0) {
+		fprintf(stderr, "bundle: %s: %s\n", dir, strerror(errno));
+		goto out;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, BUNDLE_MAGIC, sizeof(header.magic));
+	header.nr_files = pack_nr_files;
+	header.nr_buckets = pack_nr_files / BUNDLE_BUCKET_SIZE + 1;
+	header.nr_slots = pack_nr_files + pack_nr_files / 4 + 1;
+	displacements = Malloc(sizeof(uint32_t) * header.nr_buckets);
+	memset(displacements, 0, sizeof(uint32_t) * header.nr_buckets);
+	slots = Malloc(sizeof(struct bundle_entry) * header.nr_slots);
+	memset(slots, 0, sizeof(struct bundle_entry) * header.nr_slots);
+	slot_files = Malloc(sizeof(int) * header.nr_slots);
+	if (!bundle_hash_files(&header, displacements, slot_files)) {
+		fprintf(stderr, "bundle: no perfect hash for the names\n");
+		goto done;
+	}
+
+	/* the index follows the bodies, and the strings follow the index */
+	header.index_offset = pack_offset;
+	offset = header.index_offset + sizeof(uint32_t) * header.nr_buckets +
+		sizeof(struct bundle_entry) * header.nr_slots;
+	for (i = 0; i < header.nr_slots; i++) {
+		struct bundle_file *file;
+		struct bundle_entry *entry = &slots[i];
+
+		if (slot_files[i] < 0)
+			continue;
+		file = &pack_files[slot_files[i]];
+		*entry = file->entry;
+		entry->name_offset = offset;
+		bundle_write(offset, file->name, entry->name_size);
+		offset += entry->name_size;
+		entry->header_offset = offset;
+		bundle_write(offset, file->header, entry->header_size);
+		offset += entry->header_size;
+		entry->response_304_offset = offset;
+		bundle_write(offset, file->response_304,
+			     entry->response_304_size);
+		offset += entry->response_304_size;
+	}
+	bundle_write(header.index_offset, displacements,
+		     sizeof(uint32_t) * header.nr_buckets);
+	bundle_write(header.index_offset + sizeof(uint32_t) * header.nr_buckets,
+		     slots, sizeof(struct bundle_entry) * header.nr_slots);
+	header.size = offset;
+	/* written last, so a bundle that was cut short has no magic */
+	bundle_write(0, &header, sizeof(header));
+	ret = pack_nr_files;
+done:
+	free(displacements);
+	free(slots);
+	free(slot_files);
+out:
+	SYS(close(pack_fd));
+	pack_fd = -1;
+	for (i = 0; i < pack_nr_files; i++) {
+		free(pack_files[i].name);
+		free(pack_files[i].header);
+		free(pack_files[i].response_304);
+	}
+	free(pack_files);
+	pack_files = NULL;
+	pack_nr_files = 0;
+	return ret;
+}
+
+/* maps the bundle at path, so that files are served from it, see
+ * bundle_get.
+ * Returns 1 on success, 0 if there is no bundle. */
+int
+bundle_init(char *path)
+{
+	struct stat sbuf;
+	uint64_t index_size;
+	void *map;
+	int fd;
+
+	if (path == NULL)
+		return 0;
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		fprintf(stderr, "bundle: %s: %s\n", path, strerror(errno));
+		return 0;
+	}
+	SYS(fstat(fd, &sbuf));
+	if (sbuf.st_size < BUNDLE_PAGE) {
+		fprintf(stderr, "bundle: %s: not a bundle\n", path);
+		SYS(close(fd));
+		return 0;
+	}
+	map = mmap(NULL, sbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	SYS(close(fd));
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "bundle: %s: %s\n", path, strerror(errno));
+		return 0;
+	}
+	bundle_header = map;
+	index_size = sizeof(uint32_t) * bundle_header->nr_buckets +
+		sizeof(struct bundle_entry) * bundle_header->nr_slots;
+	if (memcmp(bundle_header->magic, BUNDLE_MAGIC,
+		   sizeof(bundle_header->magic)) != 0 ||
+	    bundle_header->size != sbuf.st_size ||
+	    bundle_header->nr_buckets == 0 || bundle_header->nr_slots == 0 ||
+	    bundle_header->index_offset + index_size > sbuf.st_size) {
+		fprintf(stderr, "bundle: %s: not a bundle\n", path);
+		SYS(munmap(map, sbuf.st_size));
+		return 0;
+	}
+	bundle_map = map;
+	bundle_displacements = (uint32_t *)(bundle_map +
+					    bundle_header->index_offset);
+	bundle_slots = (struct bundle_entry *)(bundle_displacements +
+					       bundle_header->nr_buckets);
+	return 1;
+}
+
+/* looks up data->file_name in the bundle, and fills in data with the file.
+ * the body and the 304 response of data are part of the bundle, and must
+ * not be freed. *header is set to the header of the 200 response, see
+ * request_sendfile_header.
+ * Returns 1 if the file is in the bundle, 0 otherwise. */
+int
+bundle_get(struct file_data *data, const char **header, int *header_size)
+{
+	struct bundle_entry *entry;
+	uint32_t bucket;
+	size_t size;
+
+	if (bundle_map == NULL)
+		return 0;
+	size = strlen(data->file_name);
+	bucket = bundle_hash(data->file_name, size, 0) %
+		bundle_header->nr_buckets;
+	entry = &bundle_slots[bundle_hash(data->file_name, size,
+					  bundle_displacements[bucket]) %
+			      bundle_header->nr_slots];
+	/* names that are not in the bundle have a slot too */
+	if (entry->name_size != size ||
+	    memcmp(bundle_map + entry->name_offset, data->file_name, size))
+		return 0;
+	data->file_buf = bundle_map + entry->body_offset;
+	data->file_size = entry->body_size;
+	data->file_csum = entry->csum;
+	data->file_mtime = entry->mtime;
+	memcpy(data->file_etag, entry->etag, sizeof(data->file_etag));
+	data->file_304 = bundle_map + entry->response_304_offset;
+	data->file_304_size = entry->response_304_size;
+	*header = bundle_map + entry->header_offset;
+	*header_size = entry->header_size;
+	return 1;
+}
+
+/* unmaps the bundle. the workers must be done */
+void
+bundle_exit(void)
+{
+	if (bundle_map == NULL)
+		return;
+	SYS(munmap(bundle_map, bundle_header->size));
+	bundle_map = NULL;
+}
@@ -0,0 +1,11 @@
+#ifndef __BUNDLE_H__
+#define __BUNDLE_H__
+
+struct file_data;
+
+int bundle_pack(char *dir, char *path);
+int bundle_init(char *path);
+int bundle_get(struct file_data *data, const char **header, int *header_size);
+void bundle_exit(void);
+
+#endif /* __BUNDLE_H__ */
@@ -0,0 +1,395 @@
+/*
+ * cache_mem.c: The memory manager for cached file bodies. All bodies are
+ * carved out of one region that is reserved up front, so the memory used by
+ * the cache can't grow past the region and doesn't fragment the malloc heap.
+ * The region is backed by huge pages when possible, which also cuts down on
+ * TLB misses when the server scans cached files.
+ *
+ * The region is managed in pages. Runs of pages (spans) are either free,
+ * slabs that are cut into objects of one size class, or extents that hold
+ * one large object. Small objects are rounded up to one of a few size
+ * classes, four per power of two, so no more than 20% of an object is
+ * wasted. Large objects are rounded up to pages.
+ *
+ * cache_mem_free and cache_mem_usable also accept memory from malloc, so
+ * callers can fall back to malloc when the region is full.
+ */
+
+#include <malloc.h>
+#include "common.h"
+#include "cache_mem.h"
+
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1UL << PAGE_SHIFT)
+/* the region is a multiple of the huge page size */
+#define HUGE_PAGE_SIZE (2UL * 1024 * 1024)
+/* objects larger than this get an extent of their own */
+#define MAX_SMALL_SIZE (32 * 1024)
+/* a slab has this many pages, so that it holds at least 4 objects */
+#define SLAB_PAGES 32
+#define MAX_CLASSES 64
+
+#define SPAN_FREE -1
+#define SPAN_EXTENT -2
+
+struct span {
+	size_t page;		/* first page of the span */
+	size_t npages;
+	int cls;		/* size class, SPAN_FREE or SPAN_EXTENT */
+	int nr_used;		/* objects in use, for slabs */
+	void *free_objs;	/* list of free objects, for slabs */
+	struct span *prev;	/* in the free list, or in the list of slabs */
+	struct span *next;	/* of the size class with free objects */
+};
+
+static pthread_mutex_t mem_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *region = NULL;
+static size_t region_size = 0;
+static size_t trim_size = PAGE_SIZE;	/* the page size of the region */
+static size_t nr_pages = 0;
+static struct span **page_map = NULL;	/* page -> span that holds it */
+static struct span *free_spans = NULL;	/* ordered by page */
+static struct span *slabs[MAX_CLASSES];	/* slabs with free objects */
+static size_t class_size[MAX_CLASSES];
+static int nr_classes = 0;
+static size_t used_bytes = 0;	/* pages in spans that are not free */
+
+static void
+list_remove(struct span **list, struct span *s)
+{
+	if (s->prev)
+		s->prev->next = s->next;
+	else
+		*list = s->next;
+	if (s->next)
+		s->next->prev = s->prev;
+	s->prev = s->next = NULL;
+}
+
+static void
+list_push(struct span **list, struct span *s)
+{
+	s->prev = NULL;
+	s->next = *list;
+	if (*list)
+		(*list)->prev = s;
+	*list = s;
+}
+
+static void
+map_span(struct span *s, int all_pages)
+{
+	size_t i;
+
+	if (all_pages) {
+		for (i = 0; i < s->npages; i++)
+			page_map[s->page + i] = s;
+	} else {
+		/* free spans only need their ends, for coalescing */
+		page_map[s->page] = s;
+		page_map[s->page + s->npages - 1] = s;
+	}
+}
+
+/* returns the pages of s to the free list, merging it with its neighbors */
+static void
+span_release(struct span *s)
+{
+	struct span *n, *p;
+
+	used_bytes -= s->npages << PAGE_SHIFT;
+	s->cls = SPAN_FREE;
+	if (s->page + s->npages < nr_pages &&
+	    (n = page_map[s->page + s->npages]) && n->cls == SPAN_FREE) {
+		list_remove(&free_spans, n);
+		s->npages += n->npages;
+		free(n);
+	}
+	if (s->page > 0 && (p = page_map[s->page - 1]) && p->cls == SPAN_FREE) {
+		list_remove(&free_spans, p);
+		p->npages += s->npages;
+		free(s);
+		s = p;
+	}
+	map_span(s, 0);
+	/* keep the list ordered, so that first fit packs the low pages */
+	if (free_spans == NULL || s->page < free_spans->page) {
+		list_push(&free_spans, s);
+	} else {
+		for (p = free_spans; p->next && p->next->page < s->page;
+		     p = p->next);
+		s->prev = p;
+		s->next = p->next;
+		if (p->next)
+			p->next->prev = s;
+		p->next = s;
+	}
+}
+
+/* takes npages pages off the free list, first fit */
+static struct span *
+span_alloc(size_t npages, int cls)
+{
+	struct span *s, *rest;
+
+	for (s = free_spans; s != NULL && s->npages < npages; s = s->next);
+	if (s == NULL)
+		return NULL;
+	if (s->npages > npages) {
+		/* the rest of the span stays in its place in the list */
+		rest = Malloc(sizeof(struct span));
+		rest->page = s->page + npages;
+		rest->npages = s->npages - npages;
+		rest->cls = SPAN_FREE;
+		rest->prev = s->prev;
+		rest->next = s->next;
+		if (s->prev)
+			s->prev->next = rest;
+		else
+			free_spans = rest;
+		if (s->next)
+			s->next->prev = rest;
+		s->prev = s->next = NULL;
+		map_span(rest, 0);
+		s->npages = npages;
+	} else {
+		list_remove(&free_spans, s);
+	}
+	s->cls = cls;
+	s->nr_used = 0;
+	s->free_objs = NULL;
+	map_span(s, 1);
+	used_bytes += npages << PAGE_SHIFT;
+	return s;
+}
+
+static int
+size_to_class(size_t size)
+{
+	int lo = 0, hi = nr_classes - 1;
+
+	/* smallest class that fits */
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (class_size[mid] >= size)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return lo;
+}
+
+static void *
+slab_alloc(int cls)
+{
+	struct span *s = slabs[cls];
+	char *obj;
+
+	if (s == NULL) {
+		size_t i, n;
+
+		if ((s = span_alloc(SLAB_PAGES, cls)) == NULL)
+			return NULL;
+		/* thread all the objects of the new slab on its free list */
+		n = (SLAB_PAGES << PAGE_SHIFT) / class_size[cls];
+		for (i = n; i > 0; i--) {
+			obj = region + (s->page << PAGE_SHIFT) +
+				(i - 1) * class_size[cls];
+			*(void **)obj = s->free_objs;
+			s->free_objs = obj;
+		}
+		list_push(&slabs[cls], s);
+	}
+	obj = s->free_objs;
+	s->free_objs = *(void **)obj;
+	s->nr_used++;
+	if (s->free_objs == NULL) {
+		/* the slab is full */
+		list_remove(&slabs[cls], s);
+	}
+	return obj;
+}
+
+static int
+in_region(void *ptr)
+{
+	return region != NULL && (char *)ptr >= region &&
+		(char *)ptr < region + region_size;
+}
+
+/* reserves a region of (at least) size bytes. explicit huge pages are used
+ * if the system has enough of them, and transparent huge pages otherwise.
+ * Returns 1 on success, 0 if the region could not be reserved, in which case
+ * cache_mem_alloc always fails. */
+int
+cache_mem_init(size_t size)
+{
+	struct span *s;
+	size_t sz;
+	int i;
+
+	region_size = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+	/* the huge pages must be reserved now, otherwise touching a page that
+	 * can't be had raises SIGBUS instead of failing here */
+	region = mmap(NULL, region_size, PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	trim_size = HUGE_PAGE_SIZE;
+	if (region == MAP_FAILED) {
+		trim_size = PAGE_SIZE;
+		region = mmap(NULL, region_size, PROT_READ | PROT_WRITE,
+			      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+			      -1, 0);
+		if (region == MAP_FAILED) {
+			perror("mmap");
+			region = NULL;
+			region_size = 0;
+			return 0;
+		}
+		madvise(region, region_size, MADV_HUGEPAGE);
+	}
+
+	/* four size classes per power of two */
+	nr_classes = 0;
+	for (sz = 64; sz < MAX_SMALL_SIZE; sz *= 2) {
+		for (i = 0; i < 4; i++) {
+			class_size[nr_classes++] = sz + i * (sz / 4);
+		}
+	}
+	class_size[nr_classes++] = MAX_SMALL_SIZE;
+	memset(slabs, 0, sizeof(slabs));
+
+	nr_pages = region_size >> PAGE_SHIFT;
+	page_map = Malloc(sizeof(struct span *) * nr_pages);
+	memset(page_map, 0, sizeof(struct span *) * nr_pages);
+	s = Malloc(sizeof(struct span));
+	s->page = 0;
+	s->npages = nr_pages;
+	s->cls = SPAN_FREE;
+	s->prev = s->next = NULL;
+	map_span(s, 0);
+	free_spans = s;
+	used_bytes = 0;
+	return 1;
+}
+
+/* Returns size bytes from the region, or NULL when the region is full */
+void *
+cache_mem_alloc(size_t size)
+{
+	struct span *s;
+	void *ptr;
+
+	if (region == NULL || size == 0)
+		return NULL;
+	pthread_mutex_lock(&mem_lock);
+	if (size <= MAX_SMALL_SIZE) {
+		ptr = slab_alloc(size_to_class(size));
+	} else {
+		s = span_alloc((size + PAGE_SIZE - 1) >> PAGE_SHIFT,
+			       SPAN_EXTENT);
+		ptr = s ? region + (s->page << PAGE_SHIFT) : NULL;
+	}
+	pthread_mutex_unlock(&mem_lock);
+	return ptr;
+}
+
+/* frees memory from cache_mem_alloc, or from malloc */
+void
+cache_mem_free(void *ptr)
+{
+	struct span *s;
+
+	if (!in_region(ptr)) {
+		free(ptr);
+		return;
+	}
+	pthread_mutex_lock(&mem_lock);
+	s = page_map[((char *)ptr - region) >> PAGE_SHIFT];
+	if (s->cls == SPAN_EXTENT) {
+		span_release(s);
+	} else {
+		if (s->free_objs == NULL) {
+			/* the slab was full */
+			list_push(&slabs[s->cls], s);
+		}
+		*(void **)ptr = s->free_objs;
+		s->free_objs = ptr;
+		if (--s->nr_used == 0) {
+			list_remove(&slabs[s->cls], s);
+			span_release(s);
+		}
+	}
+	pthread_mutex_unlock(&mem_lock);
+}
+
+/* the number of bytes that ptr really takes, from the region or the heap */
+size_t
+cache_mem_usable(void *ptr)
+{
+	struct span *s;
+	size_t size;
+
+	if (ptr == NULL)
+		return 0;
+	if (!in_region(ptr))
+		return malloc_usable_size(ptr);
+	pthread_mutex_lock(&mem_lock);
+	s = page_map[((char *)ptr - region) >> PAGE_SHIFT];
+	if (s->cls == SPAN_EXTENT)
+		size = s->npages << PAGE_SHIFT;
+	else
+		size = class_size[s->cls];
+	pthread_mutex_unlock(&mem_lock);
+	return size;
+}
+
+/* gives the free pages of the region back to the system, after the cache
+ * shrank. they are zeroed when they are used again */
+void
+cache_mem_trim(void)
+{
+	struct span *s;
+	size_t start, end;
+
+	pthread_mutex_lock(&mem_lock);
+	for (s = free_spans; s != NULL; s = s->next) {
+		start = ((s->page << PAGE_SHIFT) + trim_size - 1) &
+			~(trim_size - 1);
+		end = ((s->page + s->npages) << PAGE_SHIFT) & ~(trim_size - 1);
+		if (start < end)
+			madvise(region + start, end - start, MADV_DONTNEED);
+	}
+	pthread_mutex_unlock(&mem_lock);
+}
+
+/* the size of the region, and the bytes of it that are in use. pages of a
+ * slab are in use as long as any of its objects is */
+void
+cache_mem_stats(size_t *reserved, size_t *used)
+{
+	pthread_mutex_lock(&mem_lock);
+	*reserved = region_size;
+	*used = used_bytes;
+	pthread_mutex_unlock(&mem_lock);
+}
+
+void
+cache_mem_exit(void)
+{
+	struct span *s;
+	size_t i, npages;
+
+	if (region == NULL)
+		return;
+	/* spans tile the region, and each is mapped at its first page */
+	for (i = 0; i < nr_pages; i += npages) {
+		s = page_map[i];
+		npages = s->npages;
+		free(s);
+	}
+	free(page_map);
+	page_map = NULL;
+	SYS(munmap(region, region_size));
+	region = NULL;
+	free_spans = NULL;
+}
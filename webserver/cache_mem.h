@@ -0,0 +1,14 @@
+#ifndef __CACHE_MEM_H__
+#define __CACHE_MEM_H__
+
+#include <stddef.h>
+
+int cache_mem_init(size_t size);
+void *cache_mem_alloc(size_t size);
+void cache_mem_free(void *ptr);
+size_t cache_mem_usable(void *ptr);
+void cache_mem_trim(void);
+void cache_mem_stats(size_t *reserved, size_t *used);
+void cache_mem_exit(void);
+
+#endif /* __CACHE_MEM_H__ */
@@ -24,6 +24,17 @@ Malloc(size_t size)
 	return rc;
 }
 
+void *
+Realloc(void *ptr, size_t size)
+{
+	void *rc;
+	rc = realloc(ptr, size);
+	if (!rc) {
+		unix_error("realloc");
+	}
+	return rc;
+}
+
 /*********************************************************************
  * The Rio package - robust I/O functions
  **********************************************************************/
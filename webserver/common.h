@@ -64,6 +64,7 @@
 
 /* Memory managment wrappers */
 void *Malloc(size_t size);
+void *Realloc(void *ptr, size_t size);
 
 /* Persistent state for the robust I/O (Rio) package */
 struct rio;
@@ -0,0 +1,115 @@
+/*
+ * content.c: The contents of cached files, kept once for all the files that
+ * are byte for byte identical, e.g., copies of a file under versioned names.
+ *
+ * A cached file refers to its contents, and the contents are counted
+ * references to a buffer. Contents are found by their size and checksum,
+ * which every cached file has anyway, so they need no extra pass over the
+ * file, and are compared byte by byte before they are shared, so files that
+ * only have the same checksum are never mixed up.
+ *
+ * The cache lock (see server_thread.c) protects the contents.
+ */
+
+#include "common.h"
+#include "content.h"
+
+struct content {
+	char *buf;
+	int size;
+	unsigned int csum;
+	int charge;		/* bytes charged to the cache for buf */
+	int refs;		/* files that have these contents */
+	struct content *next;	/* next contents in the same hash bucket */
+};
+
+static struct content **content_table = NULL;
+static int content_table_size = 0;
+
+static unsigned int
+content_hash(int size, unsigned int csum)
+{
+	return (csum * 2654435761u ^ (unsigned int)size) % content_table_size;
+}
+
+/* keeps contents in a hash table of table_size buckets */
+void
+content_init(int table_size)
+{
+	content_table_size = table_size;
+	content_table = Malloc(sizeof(struct content *) * table_size);
+	memset(content_table, 0, sizeof(struct content *) * table_size);
+}
+
+/* finds the contents that are identical to the size bytes of buf, whose
+ * checksum is csum, and takes a reference to them. when there are none, buf
+ * becomes new contents, which charge bytes of the cache.
+ * Returns the contents, whose buffer is buf if they are new, or NULL if
+ * contents are not shared. */
+struct content *
+content_get(char *buf, int size, unsigned int csum, int charge)
+{
+	struct content **bucket, *c;
+
+	if (content_table == NULL)
+		return NULL;
+	bucket = &content_table[content_hash(size, csum)];
+	for (c = *bucket; c != NULL; c = c->next) {
+		if (c->size == size && c->csum == csum &&
+		    memcmp(c->buf, buf, size) == 0) {
+			c->refs++;
+			return c;
+		}
+	}
+	c = Malloc(sizeof(struct content));
+	c->buf = buf;
+	c->size = size;
+	c->csum = csum;
+	c->charge = charge;
+	c->refs = 1;
+	c->next = *bucket;
+	*bucket = c;
+	return c;
+}
+
+char *
+content_buf(struct content *c)
+{
+	return c->buf;
+}
+
+int
+content_refs(struct content *c)
+{
+	return c->refs;
+}
+
+/* drops a reference to the contents.
+ * Returns the bytes they charged to the cache if that was the last one, and
+ * the caller then frees the buffer, or 0 otherwise. */
+int
+content_put(struct content *c)
+{
+	struct content **prev;
+	int charge;
+
+	if (--c->refs > 0)
+		return 0;
+	prev = &content_table[content_hash(c->size, c->csum)];
+	while (*prev != c) {
+		prev = &(*prev)->next;
+	}
+	*prev = c->next;
+	charge = c->charge;
+	free(c);
+	return charge;
+}
+
+/* the cached files, and so their contents, must have been freed */
+void
+content_exit(void)
+{
+	free(content_table);
+	content_table = NULL;
+	content_table_size = 0;
+}
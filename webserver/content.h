@@ -0,0 +1,14 @@
+#ifndef __CONTENT_H__
+#define __CONTENT_H__
+
+struct content;
+
+void content_init(int table_size);
+struct content *content_get(char *buf, int size, unsigned int csum,
+			    int charge);
+char *content_buf(struct content *c);
+int content_refs(struct content *c);
+int content_put(struct content *c);
+void content_exit(void);
+
+#endif /* __CONTENT_H__ */
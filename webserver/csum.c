@@ -0,0 +1,158 @@
+/*
+ * csum.c: The very trivial checksum used by the server, the client and the
+ * fileset generator, which is the sum of all the bytes of a file. The sum is
+ * computed with AVX2 or SSE2 instructions when the processor supports them,
+ * and with a plain loop otherwise. The kernel is picked once, at startup.
+ *
+ * Setting the CSUM_KERNEL environment variable to "avx2", "sse2" or "scalar"
+ * forces a kernel, e.g., to measure how much the vector kernels help.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <immintrin.h>
+#include "csum.h"
+
+/* csum_process works on blocks of this size, so that all the passes over a
+ * block are served from the L1 cache */
+#define CSUM_BLOCK_SIZE (16 * 1024)
+
+static unsigned int
+csum_scalar(const unsigned char *p, size_t n)
+{
+	unsigned int s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+	size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		s0 += p[i];
+		s1 += p[i + 1];
+		s2 += p[i + 2];
+		s3 += p[i + 3];
+	}
+	for (; i < n; i++) {
+		s0 += p[i];
+	}
+	return s0 + s1 + s2 + s3;
+}
+
+/* psadbw against zero adds up each group of 8 bytes into a 64-bit lane */
+__attribute__ ((target("sse2")))
+static unsigned int
+csum_sse2(const unsigned char *p, size_t n)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i acc0 = zero, acc1 = zero;
+	size_t i;
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		__m128i v0 = _mm_loadu_si128((const __m128i *)(p + i));
+		__m128i v1 = _mm_loadu_si128((const __m128i *)(p + i + 16));
+		acc0 = _mm_add_epi64(acc0, _mm_sad_epu8(v0, zero));
+		acc1 = _mm_add_epi64(acc1, _mm_sad_epu8(v1, zero));
+	}
+	acc0 = _mm_add_epi64(acc0, acc1);
+	acc0 = _mm_add_epi64(acc0, _mm_unpackhi_epi64(acc0, acc0));
+	return (unsigned int)_mm_cvtsi128_si64(acc0) + csum_scalar(p + i, n - i);
+}
+
+__attribute__ ((target("avx2")))
+static unsigned int
+csum_avx2(const unsigned char *p, size_t n)
+{
+	__m256i zero = _mm256_setzero_si256();
+	__m256i acc0 = zero, acc1 = zero;
+	__m128i acc;
+	size_t i;
+
+	for (i = 0; i + 64 <= n; i += 64) {
+		__m256i v0 = _mm256_loadu_si256((const __m256i *)(p + i));
+		__m256i v1 = _mm256_loadu_si256((const __m256i *)(p + i + 32));
+		acc0 = _mm256_add_epi64(acc0, _mm256_sad_epu8(v0, zero));
+		acc1 = _mm256_add_epi64(acc1, _mm256_sad_epu8(v1, zero));
+	}
+	acc0 = _mm256_add_epi64(acc0, acc1);
+	acc = _mm_add_epi64(_mm256_castsi256_si128(acc0),
+			    _mm256_extracti128_si256(acc0, 1));
+	acc = _mm_add_epi64(acc, _mm_unpackhi_epi64(acc, acc));
+	return (unsigned int)_mm_cvtsi128_si64(acc) + csum_scalar(p + i, n - i);
+}
+
+struct csum_kernel {
+	const char *name;
+	unsigned int (*sum)(const unsigned char *p, size_t n);
+};
+
+static const struct csum_kernel kernels[] = {
+	{"avx2", csum_avx2},
+	{"sse2", csum_sse2},
+	{"scalar", csum_scalar},
+};
+
+static const struct csum_kernel *kernel = &kernels[2];
+
+/* whether the processor can run kernel k */
+static int
+csum_supported(const struct csum_kernel *k)
+{
+	if (k->sum == csum_avx2)
+		return __builtin_cpu_supports("avx2");
+	if (k->sum == csum_sse2)
+		return __builtin_cpu_supports("sse2");
+	return 1;
+}
+
+/* picks the fastest supported kernel, or the one named by CSUM_KERNEL */
+__attribute__ ((constructor))
+static void
+csum_init(void)
+{
+	char *name = getenv("CSUM_KERNEL");
+	int i;
+
+	__builtin_cpu_init();
+	for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+		if (name && strcmp(name, kernels[i].name) != 0)
+			continue;
+		if (csum_supported(&kernels[i])) {
+			kernel = &kernels[i];
+			return;
+		}
+	}
+}
+
+/* returns the sum of the n bytes at buf */
+unsigned int
+csum_bytes(const void *buf, size_t n)
+{
+	return kernel->sum(buf, n);
+}
+
+/* makes passes over the n bytes at buf, as the server's artificial
+ * processing does, and returns their sum. all the passes over each block are
+ * done while the block is in the L1 cache, so the data is only brought in
+ * from memory once, and the checksum comes for free with the first pass. */
+unsigned int
+csum_process(const void *buf, size_t n, int passes)
+{
+	const unsigned char *p = buf;
+	unsigned int csum = 0;
+	volatile unsigned int dummy = 0;
+	size_t off, len;
+	int i;
+
+	for (off = 0; off < n; off += len) {
+		len = (n - off < CSUM_BLOCK_SIZE) ? n - off : CSUM_BLOCK_SIZE;
+		csum += kernel->sum(p + off, len);
+		for (i = 1; i < passes; i++) {
+			dummy += kernel->sum(p + off, len);
+		}
+	}
+	return csum;
+}
+
+/* the name of the kernel in use */
+const char *
+csum_kernel(void)
+{
+	return kernel->name;
+}
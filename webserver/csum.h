@@ -0,0 +1,10 @@
+#ifndef __CSUM_H__
+#define __CSUM_H__
+
+#include <stddef.h>
+
+unsigned int csum_bytes(const void *buf, size_t n);
+unsigned int csum_process(const void *buf, size_t n, int passes);
+const char *csum_kernel(void);
+
+#endif /* __CSUM_H__ */
@@ -8,6 +8,8 @@
 #include <errno.h>
 #include <popt.h>
 #include "common.h"
+#include "csum.h"
+#include "bundle.h"
 
 /* Generate a set of files for the webserver assignment */
 
@@ -30,6 +32,7 @@ usage()
 static int default_file_sz = DEFAULT_MEAN_FILE_SZ;
 static int default_nr_files = DEFAULT_NR_FILES;
 static char *dir = STR(DEFAULT_DIR);
+static char *bundle = NULL;
 
 int
 main(int argc, const char *argv[])
@@ -55,6 +58,9 @@ main(int argc, const char *argv[])
 		{NULL, 'd', POPT_ARG_STRING, &dir, 'd',
 		 "directory in which the files are created",
 		 " default: " STR(DEFAULT_DIR)},
+		{NULL, 'b', POPT_ARG_STRING, &bundle, 'b',
+		 "pack the files in the directory into this bundle, for "
+		 "server --bundle, instead of creating files", NULL},
 		POPT_AUTOHELP {NULL, 0, 0, NULL, 0}
 	};
 
@@ -78,6 +84,15 @@ main(int argc, const char *argv[])
 		fprintf(stderr, "dir name is too long\n");
 		usage();
 	}
+	if (bundle) {
+		/* the directory is relative to the document root of the
+		 * server, see bundle_pack */
+		nr_files = bundle_pack(dir, bundle);
+		if (nr_files < 0)
+			exit(1);
+		printf("bundle = %s, nr files = %d\n", bundle, nr_files);
+		exit(0);
+	}
 	d = opendir(dir);
 	if (d) { /* directory exists */
 		struct dirent *p;
@@ -127,8 +142,8 @@ main(int argc, const char *argv[])
 			for (j = 0; j < sz; j++) {
 				/* printable characters lie between 0x20-0x73 */
 				buf[j] = random() % (0x73 - 0x20) + 0x20;
-				csum += (unsigned char)(buf[j]);
 			}
+			csum += csum_bytes(buf, sz);
 			Rio_write(fd, buf, sz);
 			remaining -= sz;
 		}
@@ -0,0 +1,150 @@
+/*
+ * handoff.c: Passing a running server on to a new one, for restarts that
+ * clients don't notice.
+ *
+ * The running server listens on a Unix socket. The new server connects to
+ * it, and gets the listening socket of the running server over SCM_RIGHTS,
+ * so no connection is refused while the two servers change places. The
+ * running server then stops accepting, sends the files in its cache over
+ * the same connection (see server_handoff), and exits once the requests it
+ * has accepted are served.
+ */
+
+#include "common.h"
+#include "handoff.h"
+#include <sys/un.h>
+
+static void
+handoff_addr(char *path, struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	snprintf(addr->sun_path, sizeof(addr->sun_path), "%s", path);
+}
+
+/* creates the control socket at path, replacing the one of an earlier
+ * server. Returns the socket */
+int
+handoff_listen(char *path)
+{
+	struct sockaddr_un addr;
+	int sock;
+
+	handoff_addr(path, &addr);
+	SYS(sock = socket(AF_UNIX, SOCK_STREAM, 0));
+	unlink(path);
+	SYS(bind(sock, (struct sockaddr *)&addr, sizeof(addr)));
+	SYS(listen(sock, 1));
+	return sock;
+}
+
+/* connects to the control socket of a running server.
+ * Returns the connection, or -1 if no server is running */
+int
+handoff_connect(char *path)
+{
+	struct sockaddr_un addr;
+	int sock;
+
+	handoff_addr(path, &addr);
+	SYS(sock = socket(AF_UNIX, SOCK_STREAM, 0));
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		SYS(close(sock));
+		return -1;
+	}
+	return sock;
+}
+
+/* sends fd over sock. Returns 1 on success, 0 otherwise */
+int
+handoff_send_fd(int sock, int fd)
+{
+	char byte = 0;
+	char control[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = {&byte, 1};
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(control, 0, sizeof(control));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	return sendmsg(sock, &msg, MSG_NOSIGNAL) == 1;
+}
+
+/* receives a file descriptor sent by handoff_send_fd.
+ * Returns the file descriptor, or -1 on failure */
+int
+handoff_recv_fd(int sock)
+{
+	char byte;
+	char control[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = {&byte, 1};
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	int fd;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	if (recvmsg(sock, &msg, 0) != 1)
+		return -1;
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+	    cmsg->cmsg_type != SCM_RIGHTS)
+		return -1;
+	memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+	return fd;
+}
+
+/* writes size bytes to sock. unlike Rio_write, a server that goes away
+ * doesn't make this server exit.
+ * Returns 1 on success, 0 otherwise */
+int
+handoff_write(int sock, const void *buf, size_t size)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (size > 0) {
+		if ((n = send(sock, p, size, MSG_NOSIGNAL)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return 0;
+		}
+		p += n;
+		size -= n;
+	}
+	return 1;
+}
+
+/* reads size bytes from sock.
+ * Returns 1 on success, 0 on failure or end of file */
+int
+handoff_read(int sock, void *buf, size_t size)
+{
+	char *p = buf;
+	ssize_t n;
+
+	while (size > 0) {
+		if ((n = read(sock, p, size)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return 0;
+		}
+		if (n == 0)
+			return 0;
+		p += n;
+		size -= n;
+	}
+	return 1;
+}
@@ -0,0 +1,17 @@
+#ifndef __HANDOFF_H__
+#define __HANDOFF_H__
+
+#include <stddef.h>
+
+/* the control socket on which a running server waits for the server that
+ * takes over from it, see server.c */
+#define HANDOFF_PATH "./server_restart.sock"
+
+int handoff_listen(char *path);
+int handoff_connect(char *path);
+int handoff_send_fd(int sock, int fd);
+int handoff_recv_fd(int sock);
+int handoff_write(int sock, const void *buf, size_t size);
+int handoff_read(int sock, void *buf, size_t size);
+
+#endif /* __HANDOFF_H__ */
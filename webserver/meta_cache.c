@@ -0,0 +1,231 @@
+/*
+ * meta_cache.c: A bounded cache of what request_checkfile found out about
+ * files, so that the path checks and the stat system call are not repeated
+ * for every request. Files that can't be served are cached too (negative
+ * entries), together with their preformatted error response. Entries expire
+ * after a time-to-live, so changes to the files are noticed eventually.
+ */
+
+#include "common.h"
+#include "request.h"
+#include "meta_cache.h"
+
+struct meta_entry {
+	char *file_name;
+	struct file_meta meta;
+	long expires;		     /* in ms, see meta_cache_now */
+	struct meta_entry *next;     /* next entry in the same hash bucket */
+	struct meta_entry *fifo_prev; /* entries are evicted oldest first */
+	struct meta_entry *fifo_next;
+};
+
+static pthread_mutex_t meta_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct meta_entry **meta_table = NULL;
+static int meta_table_size = 0;
+static int meta_nr_entries = 0;
+static int meta_max_entries = 0;
+static long meta_ttl = 0;
+/* an invalidation bumps one of these, so that metadata found out before the
+ * change is not cached after it */
+#define META_GENERATIONS 256
+static unsigned int meta_generation[META_GENERATIONS];
+static struct meta_entry *fifo_head = NULL;	/* oldest */
+static struct meta_entry *fifo_tail = NULL;	/* newest */
+
+/* current time in ms, not affected by changes to the system time */
+static long
+meta_cache_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* djb2 hash function */
+static unsigned long
+meta_hash(char *str)
+{
+	unsigned long hash = 5381;
+	int c;
+
+	while ((c = *str++))
+		hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+	return hash % meta_table_size;
+}
+
+static void
+meta_copy(struct file_meta *dst, struct file_meta *src)
+{
+	*dst = *src;
+	if (src->error) {
+		dst->error = Malloc(src->error_size);
+		memcpy(dst->error, src->error, src->error_size);
+	}
+}
+
+static struct meta_entry *
+meta_find(char *file_name)
+{
+	struct meta_entry *e = meta_table[meta_hash(file_name)];
+
+	while (e != NULL && strcmp(e->file_name, file_name) != 0) {
+		e = e->next;
+	}
+	return e;
+}
+
+/* unlinks an entry from its hash bucket and the fifo list, and frees it */
+static void
+meta_remove(struct meta_entry *e)
+{
+	struct meta_entry **prev = &meta_table[meta_hash(e->file_name)];
+
+	while (*prev != e) {
+		prev = &(*prev)->next;
+	}
+	*prev = e->next;
+	if (e->fifo_prev) {
+		e->fifo_prev->fifo_next = e->fifo_next;
+	} else {
+		fifo_head = e->fifo_next;
+	}
+	if (e->fifo_next) {
+		e->fifo_next->fifo_prev = e->fifo_prev;
+	} else {
+		fifo_tail = e->fifo_prev;
+	}
+	meta_nr_entries--;
+	free(e->file_name);
+	free(e->meta.error);
+	free(e);
+}
+
+/* max_entries bounds the number of cached files, ttl is in ms */
+void
+meta_cache_init(int max_entries, int ttl)
+{
+	if (max_entries <= 0) {
+		return;
+	}
+	meta_max_entries = max_entries;
+	meta_table_size = max_entries;
+	meta_table = Malloc(sizeof(struct meta_entry *) * meta_table_size);
+	memset(meta_table, 0, sizeof(struct meta_entry *) * meta_table_size);
+	meta_ttl = ttl;
+}
+
+/* Returns 1 and fills meta with a copy of the cached metadata of file_name,
+ * whose error response should be freed by the caller.
+ * Returns 0 if file_name is not cached, or its entry has expired. generation
+ * should then be passed to meta_cache_insert along with the new metadata. */
+int
+meta_cache_lookup(char *file_name, struct file_meta *meta,
+		  unsigned int *generation)
+{
+	struct meta_entry *e;
+	int ret = 0;
+
+	*generation = 0;
+	if (meta_table == NULL) {
+		return 0;
+	}
+	pthread_mutex_lock(&meta_lock);
+	*generation = meta_generation[meta_hash(file_name) % META_GENERATIONS];
+	e = meta_find(file_name);
+	if (e != NULL) {
+		if (e->expires > meta_cache_now()) {
+			meta_copy(meta, &e->meta);
+			ret = 1;
+		} else {
+			meta_remove(e);
+		}
+	}
+	pthread_mutex_unlock(&meta_lock);
+	return ret;
+}
+
+/* caches a copy of meta for file_name, evicting the oldest entry when the
+ * cache is full. nothing is cached if file_name was invalidated after
+ * generation was returned by meta_cache_lookup. */
+void
+meta_cache_insert(char *file_name, struct file_meta *meta,
+		  unsigned int generation)
+{
+	struct meta_entry *e;
+	int index;
+
+	if (meta_table == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&meta_lock);
+	index = meta_hash(file_name);
+	if (generation != meta_generation[index % META_GENERATIONS]) {
+		pthread_mutex_unlock(&meta_lock);
+		return;
+	}
+	if ((e = meta_find(file_name)) != NULL) {
+		meta_remove(e);
+	}
+	if (meta_nr_entries >= meta_max_entries) {
+		meta_remove(fifo_head);
+	}
+	e = Malloc(sizeof(struct meta_entry));
+	e->file_name = Malloc(strlen(file_name) + 1);
+	strcpy(e->file_name, file_name);
+	meta_copy(&e->meta, meta);
+	e->expires = meta_cache_now() + meta_ttl;
+
+	e->next = meta_table[index];
+	meta_table[index] = e;
+	e->fifo_next = NULL;
+	e->fifo_prev = fifo_tail;
+	if (fifo_tail) {
+		fifo_tail->fifo_next = e;
+	} else {
+		fifo_head = e;
+	}
+	fifo_tail = e;
+	meta_nr_entries++;
+	pthread_mutex_unlock(&meta_lock);
+}
+
+/* drops the cached metadata of file_name, e.g., because it has changed.
+ * when file_name is NULL, all cached metadata is dropped */
+void
+meta_cache_invalidate(char *file_name)
+{
+	struct meta_entry *e;
+
+	if (meta_table == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&meta_lock);
+	if (file_name == NULL) {
+		for (int i = 0; i < META_GENERATIONS; i++) {
+			meta_generation[i]++;
+		}
+		while (fifo_head != NULL) {
+			meta_remove(fifo_head);
+		}
+	} else {
+		meta_generation[meta_hash(file_name) % META_GENERATIONS]++;
+		if ((e = meta_find(file_name)) != NULL) {
+			meta_remove(e);
+		}
+	}
+	pthread_mutex_unlock(&meta_lock);
+}
+
+void
+meta_cache_exit(void)
+{
+	if (meta_table == NULL) {
+		return;
+	}
+	while (fifo_head != NULL) {
+		meta_remove(fifo_head);
+	}
+	free(meta_table);
+	meta_table = NULL;
+}
@@ -0,0 +1,14 @@
+#ifndef __META_CACHE_H__
+#define __META_CACHE_H__
+
+struct file_meta;
+
+void meta_cache_init(int max_entries, int ttl);
+int meta_cache_lookup(char *file_name, struct file_meta *meta,
+		      unsigned int *generation);
+void meta_cache_insert(char *file_name, struct file_meta *meta,
+		       unsigned int generation);
+void meta_cache_invalidate(char *file_name);
+void meta_cache_exit(void);
+
+#endif /* __META_CACHE_H__ */
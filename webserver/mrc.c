@@ -0,0 +1,300 @@
+/*
+ * mrc.c: The miss ratio curve of the requests the server sees, i.e., the hit
+ * ratio that an LRU cache of each size would have, estimated online, so the
+ * cache can be sized from real traffic instead of from a run per size.
+ *
+ * The reuse distance of a request is the bytes of the distinct files that
+ * were requested since the last request for the same file, plus the file.
+ * An LRU cache hits when its size is at least the reuse distance, so a
+ * histogram of reuse distances is the hit ratio curve.
+ *
+ * Requests are sampled by SHARDS (Waldspurger et al., FAST '15): a file is
+ * sampled when the hash of its name is below a threshold, so every request
+ * for a sampled file is seen, and distances are scaled up by the sampling
+ * rate. The distances are found with a Fenwick tree over the times of the
+ * last requests for the sampled files, which holds the size of each file at
+ * the time of its last request. When more than MRC_MAX_FILES files are
+ * sampled, the threshold is lowered, dropping the files with the highest
+ * hashes, and the histogram is scaled to the new rate.
+ */
+
+#include "common.h"
+#include "mrc.h"
+
+/* sampled files are chosen among this many hash values */
+#define MRC_MODULUS (1 << 24)
+#define MRC_MAX_FILES 65536
+/* the threshold is lowered to drop one in this many sampled files */
+#define MRC_DROP 8
+/* times of the Fenwick tree, which are renumbered when they run out */
+#define MRC_TIMES (4 * MRC_MAX_FILES)
+#define MRC_BUCKETS 1024
+/* the smallest size up to which the curve is estimated */
+#define MRC_MIN_SIZE (16 * 1024 * 1024)
+
+struct mrc_file {
+	unsigned long long hash;
+	int size;
+	int time;		/* of the last request */
+	struct mrc_file *next;	/* in the same hash bucket */
+};
+
+static pthread_mutex_t mrc_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct mrc_file **mrc_table = NULL;	/* 2 * MRC_MAX_FILES buckets */
+static int mrc_nr_files = 0;
+static long long *mrc_tree = NULL;	/* Fenwick tree, indexed from 1 */
+static int mrc_now = 1;			/* the time of the next request */
+static unsigned long mrc_threshold;	/* files whose hash is below */
+static long long mrc_bucket;		/* bytes of reuse distance per bucket */
+/* counts of requests, scaled to the current sampling rate */
+static double mrc_hist[MRC_BUCKETS + 1];	/* the last one is beyond */
+static double mrc_cold;			/* first requests for a file */
+static double mrc_total;
+static long mrc_sampled;		/* requests sampled, unscaled */
+
+/* FNV-1a of the file name, with a final mix */
+static unsigned long long
+mrc_hash(char *name)
+{
+	unsigned long long h = 14695981039346656037ull;
+
+	for (; *name; name++)
+		h = (h ^ (unsigned char)*name) * 1099511628211ull;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+	return h;
+}
+
+static void
+mrc_tree_add(int time, long long size)
+{
+	for (; time <= MRC_TIMES; time += time & -time)
+		mrc_tree[time] += size;
+}
+
+/* the bytes of the files whose last request was at time or before */
+static long long
+mrc_tree_sum(int time)
+{
+	long long sum = 0;
+
+	for (; time > 0; time -= time & -time)
+		sum += mrc_tree[time];
+	return sum;
+}
+
+static struct mrc_file **
+mrc_bucket_of(unsigned long long hash)
+{
+	return &mrc_table[(hash >> 24) % (2 * MRC_MAX_FILES)];
+}
+
+/* the sampled files, in no order. Returns their number */
+static int
+mrc_files(struct mrc_file **files)
+{
+	struct mrc_file *f;
+	int i, n = 0;
+
+	for (i = 0; i < 2 * MRC_MAX_FILES; i++) {
+		for (f = mrc_table[i]; f != NULL; f = f->next)
+			files[n++] = f;
+	}
+	return n;
+}
+
+static int
+mrc_by_time(const void *a, const void *b)
+{
+	return (*(struct mrc_file **)a)->time - (*(struct mrc_file **)b)->time;
+}
+
+static int
+mrc_by_hash(const void *a, const void *b)
+{
+	unsigned long ha = (*(struct mrc_file **)a)->hash % MRC_MODULUS;
+	unsigned long hb = (*(struct mrc_file **)b)->hash % MRC_MODULUS;
+
+	return ha < hb ? -1 : ha > hb;
+}
+
+/* numbers the last requests of the sampled files from 1 again, in the same
+ * order, when the times run out */
+static void
+mrc_renumber(void)
+{
+	struct mrc_file **files = Malloc(sizeof(struct mrc_file *) *
+					 mrc_nr_files);
+	int i, n = mrc_files(files);
+
+	qsort(files, n, sizeof(struct mrc_file *), mrc_by_time);
+	memset(mrc_tree, 0, sizeof(long long) * (MRC_TIMES + 1));
+	for (i = 0; i < n; i++) {
+		files[i]->time = i + 1;
+		mrc_tree_add(i + 1, files[i]->size);
+	}
+	mrc_now = n + 1;
+	free(files);
+}
+
+/* lowers the threshold so that one in MRC_DROP sampled files is dropped, and
+ * scales the counts to the new rate */
+static void
+mrc_lower(void)
+{
+	struct mrc_file **files = Malloc(sizeof(struct mrc_file *) *
+					 mrc_nr_files);
+	struct mrc_file **p, *f;
+	unsigned long threshold;
+	double scale;
+	int i, n = mrc_files(files);
+
+	qsort(files, n, sizeof(struct mrc_file *), mrc_by_hash);
+	threshold = files[n - n / MRC_DROP]->hash % MRC_MODULUS;
+	free(files);
+	for (i = 0; i < 2 * MRC_MAX_FILES; i++) {
+		for (p = &mrc_table[i]; (f = *p) != NULL;) {
+			if (f->hash % MRC_MODULUS >= threshold) {
+				mrc_tree_add(f->time, -f->size);
+				*p = f->next;
+				free(f);
+				mrc_nr_files--;
+			} else {
+				p = &f->next;
+			}
+		}
+	}
+	scale = (double)threshold / mrc_threshold;
+	for (i = 0; i <= MRC_BUCKETS; i++)
+		mrc_hist[i] *= scale;
+	mrc_cold *= scale;
+	mrc_total *= scale;
+	__atomic_store_n(&mrc_threshold, threshold, __ATOMIC_RELAXED);
+}
+
+/* samples one in every rate files, and estimates the curve up to max_size
+ * bytes, or MRC_MIN_SIZE if that is more. rate is 0 when this is off */
+void
+mrc_init(int rate, long long max_size)
+{
+	if (rate <= 0)
+		return;
+	if (max_size < MRC_MIN_SIZE)
+		max_size = MRC_MIN_SIZE;
+	mrc_bucket = (max_size + MRC_BUCKETS - 1) / MRC_BUCKETS;
+	mrc_threshold = MRC_MODULUS / rate;
+	if (mrc_threshold == 0)
+		mrc_threshold = 1;
+	mrc_table = Malloc(sizeof(struct mrc_file *) * 2 * MRC_MAX_FILES);
+	memset(mrc_table, 0, sizeof(struct mrc_file *) * 2 * MRC_MAX_FILES);
+	mrc_tree = Malloc(sizeof(long long) * (MRC_TIMES + 1));
+	memset(mrc_tree, 0, sizeof(long long) * (MRC_TIMES + 1));
+}
+
+/* counts a request for a file of size bytes */
+void
+mrc_record(char *name, int size)
+{
+	unsigned long long hash;
+	struct mrc_file **bucket, *f;
+	double distance;
+	long b;
+
+	if (mrc_table == NULL)
+		return;
+	hash = mrc_hash(name);
+	/* mrc_threshold only goes down, so this may let a file through that
+	 * is not sampled anymore, which is checked again below */
+	if (hash % MRC_MODULUS >= __atomic_load_n(&mrc_threshold,
+						   __ATOMIC_RELAXED))
+		return;
+	pthread_mutex_lock(&mrc_lock);
+	if (hash % MRC_MODULUS >= mrc_threshold) {
+		pthread_mutex_unlock(&mrc_lock);
+		return;
+	}
+	bucket = mrc_bucket_of(hash);
+	for (f = *bucket; f != NULL && f->hash != hash; f = f->next);
+	if (f != NULL) {
+		/* the other files are a sample of the files requested since */
+		distance = (double)(mrc_tree_sum(mrc_now - 1) -
+				    mrc_tree_sum(f->time)) * MRC_MODULUS /
+			   mrc_threshold + size;
+		b = (long)(distance / mrc_bucket);
+		mrc_hist[b < MRC_BUCKETS ? b : MRC_BUCKETS] += 1;
+		mrc_tree_add(f->time, -f->size);
+	} else {
+		f = Malloc(sizeof(struct mrc_file));
+		f->hash = hash;
+		f->next = *bucket;
+		*bucket = f;
+		mrc_nr_files++;
+		mrc_cold += 1;
+	}
+	f->size = size;
+	f->time = mrc_now++;
+	mrc_tree_add(f->time, size);
+	mrc_total += 1;
+	mrc_sampled++;
+	if (mrc_now > MRC_TIMES)
+		mrc_renumber();
+	if (mrc_nr_files > MRC_MAX_FILES)
+		mrc_lower();
+	pthread_mutex_unlock(&mrc_lock);
+}
+
+/* formats the curve into buf, as lines of a cache size and the hit ratio of
+ * an LRU cache of that size, for sizes that double from the size of a
+ * bucket, and for cache_size, the size of the cache.
+ * Returns the length of the text */
+int
+mrc_format(char *buf, int max, long long cache_size)
+{
+	long long size, next;
+	double hits = 0;
+	int len, b = 0;
+
+	if (mrc_table == NULL)
+		return snprintf(buf, max, "# off, see --mrc\n");
+	pthread_mutex_lock(&mrc_lock);
+	len = snprintf(buf, max, "# %ld requests sampled, at a rate of "
+		       "%.6f\n# cache_size, hit_ratio\n", mrc_sampled,
+		       (double)mrc_threshold / MRC_MODULUS);
+	for (size = mrc_bucket; len < max; size = next) {
+		/* the distances of bucket b are at most (b + 1) * mrc_bucket */
+		for (; b < MRC_BUCKETS && (b + 1) * mrc_bucket <= size; b++)
+			hits += mrc_hist[b];
+		len += snprintf(buf + len, max - len, "%lld, %.4f\n", size,
+				mrc_total > 0 ? hits / mrc_total : 0);
+		if (size >= MRC_BUCKETS * mrc_bucket)
+			break;
+		next = size * 2;
+		if (cache_size > size && cache_size < next)
+			next = cache_size;
+		if (next > MRC_BUCKETS * mrc_bucket)
+			next = MRC_BUCKETS * mrc_bucket;
+	}
+	pthread_mutex_unlock(&mrc_lock);
+	return len < max ? len : max - 1;
+}
+
+void
+mrc_exit(void)
+{
+	struct mrc_file *f, *next;
+	int i;
+
+	if (mrc_table == NULL)
+		return;
+	for (i = 0; i < 2 * MRC_MAX_FILES; i++) {
+		for (f = mrc_table[i]; f != NULL; f = next) {
+			next = f->next;
+			free(f);
+		}
+	}
+	free(mrc_table);
+	mrc_table = NULL;
+	free(mrc_tree);
+	mrc_tree = NULL;
+}
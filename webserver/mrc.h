@@ -0,0 +1,12 @@
+#ifndef __MRC_H__
+#define __MRC_H__
+
+/* the name under which the miss ratio curve is served */
+#define MRC_NAME "./__mrc"
+
+void mrc_init(int rate, long long max_size);
+void mrc_record(char *name, int size);
+int mrc_format(char *buf, int max, long long cache_size);
+void mrc_exit(void);
+
+#endif /* __MRC_H__ */
@@ -0,0 +1,82 @@
+/*
+ * pressure.c: The memory of the cgroup (v2) that the server runs in, so the
+ * cache can use the memory that is free without getting the server killed
+ * when the cgroup runs out of it.
+ *
+ * memory.current and memory.max are the memory that the cgroup uses and
+ * the most it may use. memory.pressure tells the share of time that tasks
+ * of the cgroup stalled waiting for memory, e.g., for the kernel to reclaim
+ * the page cache, which rises well before the cgroup runs out of memory.
+ */
+
+#include "common.h"
+#include "pressure.h"
+
+static char *pressure_dir = NULL;
+
+/* reads the file name of the cgroup into buf.
+ * Returns 1 on success, 0 otherwise */
+static int
+pressure_read(char *name, char *buf, int size)
+{
+	char path[MAXLINE];
+	int fd, n;
+
+	snprintf(path, sizeof(path), "%s/%s", pressure_dir, name);
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return 0;
+	n = read(fd, buf, size - 1);
+	close(fd);
+	if (n <= 0)
+		return 0;
+	buf[n] = '\0';
+	return 1;
+}
+
+/* follows the memory of the cgroup whose directory is dir, e.g.,
+ * /sys/fs/cgroup. Returns 1 if it is a cgroup v2 with a memory controller,
+ * 0 otherwise */
+int
+pressure_init(char *dir)
+{
+	char buf[64];
+
+	pressure_dir = dir;
+	if (!pressure_read("memory.current", buf, sizeof(buf))) {
+		fprintf(stderr, "pressure: %s: no cgroup v2 memory.current\n",
+			dir);
+		pressure_dir = NULL;
+		return 0;
+	}
+	return 1;
+}
+
+/* samples the memory of the cgroup. max is -1 when the cgroup has no limit,
+ * and stall is 0 when the kernel has no pressure information.
+ * Returns 1 on success, 0 otherwise */
+int
+pressure_sample(struct pressure *p)
+{
+	char buf[256], *some;
+
+	if (pressure_dir == NULL ||
+	    !pressure_read("memory.current", buf, sizeof(buf)))
+		return 0;
+	p->current = strtoll(buf, NULL, 10);
+	p->max = -1;
+	if (pressure_read("memory.max", buf, sizeof(buf)) &&
+	    strncmp(buf, "max", 3) != 0)
+		p->max = strtoll(buf, NULL, 10);
+	/* "some avg10=0.00 avg60=0.00 avg300=0.00 total=0" */
+	p->stall = 0;
+	if (pressure_read("memory.pressure", buf, sizeof(buf)) &&
+	    (some = strstr(buf, "some avg10=")) != NULL)
+		p->stall = strtod(some + strlen("some avg10="), NULL);
+	return 1;
+}
+
+void
+pressure_exit(void)
+{
+	pressure_dir = NULL;
+}
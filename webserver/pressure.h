@@ -0,0 +1,15 @@
+#ifndef __PRESSURE_H__
+#define __PRESSURE_H__
+
+struct pressure {
+	long long current;	/* bytes the cgroup uses */
+	long long max;		/* bytes it may use, or -1 */
+	double stall;		/* percent of the last 10s that some task
+				 * stalled on memory */
+};
+
+int pressure_init(char *dir);
+int pressure_sample(struct pressure *p);
+void pressure_exit(void);
+
+#endif /* __PRESSURE_H__ */
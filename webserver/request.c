@@ -2,67 +2,262 @@
  * request.c: Does the bulk of the work for the web server.
  */
 
+#define _GNU_SOURCE	/* for strptime and timegm */
+#include <zlib.h>
 #include "common.h"
 #include "request.h"
+#include "csum.h"
+#include "stats.h"
+
+/* files are read and checksummed in chunks of this size */
+#define REQUEST_READ_CHUNK (64 * 1024)
+/* mappings up to this size are faulted in by mmap, larger ones are read
+ * ahead in the background */
+#define REQUEST_POPULATE_MAX (256 * 1024)
+
+/* content codings accepted by the client */
+#define ENCODING_GZIP		0x1
+#define ENCODING_DEFLATE	0x2
 
 struct request {
 	int fd;		 /* descriptor for client connection */
 	struct file_data *data;
+	int has_range;	 /* set when the client sent a Range: header */
+	long range_first; /* first byte, or -1 for a suffix range */
+	long range_last;  /* last byte, -1 if open-ended, or suffix length */
+	char *if_none_match; /* value of the If-None-Match: header, or NULL */
+	time_t if_modified_since; /* If-Modified-Since: header, or -1 */
+	int accept_encoding; /* ENCODING_* flags from Accept-Encoding: */
+	int status;	 /* of the response, 0 until one is sent */
+	long bytes_sent; /* headers and body */
+	int faulted;	 /* a mapping of the file faulted, see request_fault */
 };
 
-/* requestError(fd, filename, "404", "Not found", 
- *		"OS server could not find this file");
- */
+/* a mapped file (see request_map) that is truncated on disk raises SIGBUS
+ * when the pages past its new end are touched, and write fails with EFAULT
+ * on them. the code that reads from a mapping, whether to checksum,
+ * compress or send it, is guarded: it sets request_fault to a jump buffer,
+ * and a fault jumps back to it, so that only the request fails, and the
+ * file is dropped from the cache, see request_map_faulted. faults outside
+ * of a guard kill the server, as before */
+static __thread sigjmp_buf *request_fault = NULL;
+
+static void
+request_sigbus(int sig)
+{
+	if (request_fault == NULL) {
+		signal(SIGBUS, SIG_DFL);
+		raise(SIGBUS);
+		return;
+	}
+	siglongjmp(*request_fault, 1);
+}
+
+/* installs the handler of the faults of truncated mappings */
+void
+request_guard_init(void)
+{
+	struct sigaction sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = request_sigbus;
+	/* the handler jumps out, so the signal must not stay blocked */
+	sa.sa_flags = SA_NODEFER;
+	sigemptyset(&sa.sa_mask);
+	SYS(sigaction(SIGBUS, &sa, NULL));
+}
+
+/* ends a guard that jumped back on a fault of the mapping of rq->data */
 static void
-request_error(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg)
+request_guard_faulted(struct request *rq)
+{
+	request_fault = NULL;
+	rq->faulted = 1;
+	fprintf(stderr, "request: %s shrank while mapped\n",
+		rq->data->file_name);
+}
+
+/* formats an error response into buf, which must hold 2 * MAXBUF bytes.
+ * Returns the size of the response.
+ *
+ * request_format_error(buf, filename, "404", "Not found", 
+ *			"OS server could not find this file");
+ */
+static int
+request_format_error(char *buf, char *cause, char *errnum, char *shortmsg,
+		     char *longmsg)
 {
-	char buf[MAXLINE], body[MAXBUF];
-	int i;
-	unsigned int csum = 0;
+	char body[MAXBUF];
+	int size = 0, body_size;
+	unsigned int csum;
 
 	/* create the body of the error message */
 	sprintf(body, "<html><title>OS Web Server Error</title>");
 	sprintf(body + strlen(body), "<body bgcolor=" "fffff" ">\r\n");
 	sprintf(body + strlen(body), "<p>%s: %s</p>\r\n", errnum, shortmsg);
-	sprintf(body + strlen(body), "<p>%s: %s</p>\r\n", longmsg, cause);
+	snprintf(body + strlen(body), MAXBUF - strlen(body) - 32,
+		 "<p>%s: %s</p>\r\n", longmsg, cause);
 	sprintf(body + strlen(body), "</body></html>\r\n");
+	body_size = strlen(body);
+
+	/* generate a very trivial checksum */
+	csum = csum_bytes(body, body_size);
 
-	/* write out the header information for this response */
-	sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-	Rio_write(fd, buf, strlen(buf));
-	printf("%s", buf);
+	/* put together the header information for this response */
+	size += sprintf(buf + size, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
+	size += sprintf(buf + size, "Content-Type: text/html\r\n");
+	size += sprintf(buf + size, "Content-Length: %d\r\n", body_size);
+	size += sprintf(buf + size, "Content-Csum: %u\r\n\r\n", csum);
 
-	sprintf(buf, "Content-Type: text/html\r\n");
-	Rio_write(fd, buf, strlen(buf));
-	printf("%s", buf);
+	/* and the content */
+	memcpy(buf + size, body, body_size);
+	return size + body_size;
+}
+
+/* writes size bytes of the response to the client, counting them */
+static void
+request_write(struct request *rq, const void *buf, long size)
+{
+	const char *p = buf;
+	long left;
+	ssize_t n;
 
-	sprintf(buf, "Content-Length: %ld\r\n", strlen(body));
-	Rio_write(fd, buf, strlen(buf));
-	printf("%s", buf);
+	for (left = size; left > 0; left -= n, p += n) {
+		n = write(rq->fd, p, left);
+		if (n < 0 && errno == EINTR) {
+			n = 0;
+			continue;
+		}
+		/* buf is a mapping that was truncated, see request_fault */
+		if (n < 0 && errno == EFAULT && request_fault != NULL)
+			siglongjmp(*request_fault, 1);
+		SYS(n);
+	}
+	rq->bytes_sent += size;
+}
 
-	/* generate a very trivial checksum */
-	for (i = 0; i < strlen(body); i++) {
-		csum += (unsigned char)(body[i]);
+/* request_error(rq, filename, "404", "Not found", 
+ *		 "OS server could not find this file");
+ */
+static void
+request_error(struct request *rq, char *cause, char *errnum, char *shortmsg,
+	      char *longmsg)
+{
+	char buf[2 * MAXBUF];
+	int size;
+
+	size = request_format_error(buf, cause, errnum, shortmsg, longmsg);
+	rq->status = atoi(errnum);
+	request_write(rq, buf, size);
+}
+
+/* parses the value of a Range: header. we only support a single byte range
+ * of the form "bytes=first-last", "bytes=first-" or "bytes=-suffix". anything
+ * else (including multiple ranges) is ignored and the whole file is sent,
+ * which is allowed by the HTTP spec. */
+static void
+request_parse_range(struct request *rq, char *value)
+{
+	long first, last;
+
+	while (isspace(*value))
+		value++;
+	if (strncasecmp(value, "bytes=", 6) != 0 || strchr(value, ',') != NULL)
+		return;
+	value += 6;
+	if (*value == '-') {
+		/* suffix range: the last 'last' bytes of the file */
+		if (sscanf(value + 1, "%ld", &last) != 1 || last < 0)
+			return;
+		first = -1;
+	} else if (sscanf(value, "%ld-%ld", &first, &last) == 2) {
+		if (first < 0 || last < first)
+			return;
+	} else if (sscanf(value, "%ld-", &first) == 1) {
+		if (first < 0)
+			return;
+		last = -1;
+	} else {
+		return;
+	}
+	rq->has_range = 1;
+	rq->range_first = first;
+	rq->range_last = last;
+}
+
+/* parses the value of an Accept-Encoding: header, e.g., "gzip, deflate;q=0.5".
+ * codings with q=0 are not acceptable. */
+static void
+request_parse_encoding(struct request *rq, char *value)
+{
+	char *token, *saveptr, *q;
+	int flag;
+
+	for (token = strtok_r(value, ",\r\n", &saveptr); token != NULL;
+	     token = strtok_r(NULL, ",\r\n", &saveptr)) {
+		while (isspace(*token))
+			token++;
+		if (strncasecmp(token, "gzip", 4) == 0) {
+			flag = ENCODING_GZIP;
+		} else if (strncasecmp(token, "deflate", 7) == 0) {
+			flag = ENCODING_DEFLATE;
+		} else if (*token == '*') {
+			flag = ENCODING_GZIP | ENCODING_DEFLATE;
+		} else {
+			continue;
+		}
+		q = strstr(token, "q=");
+		if (q && strtod(q + 2, NULL) == 0) {
+			rq->accept_encoding &= ~flag;
+		} else {
+			rq->accept_encoding |= flag;
+		}
 	}
-	sprintf(buf, "Content-Csum: %u\r\n\r\n", csum);
-	Rio_write(fd, buf, strlen(buf));
-	printf("%s", buf);
+}
+
+/* formats t as an HTTP date, e.g., "Sun, 06 Nov 1994 08:49:37 GMT" */
+static void
+request_format_date(time_t t, char *buf, size_t max)
+{
+	struct tm tm;
 
-	/* write out the content */
-	Rio_write(fd, body, strlen(body));
-	printf("%s", body);
+	gmtime_r(&t, &tm);
+	strftime(buf, max, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
 
+/* parses an HTTP date. Returns -1 if the date can't be parsed. */
+static time_t
+request_parse_date(char *value)
+{
+	struct tm tm;
+
+	while (isspace(*value))
+		value++;
+	memset(&tm, 0, sizeof(tm));
+	if (strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm) == NULL)
+		return -1;
+	return timegm(&tm);
 }
 
-/* reads and discards everything up to an empty text line */
+/* reads everything up to an empty text line, picking out the headers that
+ * we understand */
 static void
-request_read_headers(struct rio *rp)
+request_read_headers(struct request *rq, struct rio *rp)
 {
 	char buf[MAXLINE];
 
-	Rio_readlineb(rp, buf, MAXLINE);
-	while (strcmp(buf, "\r\n")) {
-		Rio_readlineb(rp, buf, MAXLINE);
+	while (Rio_readlineb(rp, buf, MAXLINE) > 0 && strcmp(buf, "\r\n")) {
+		if (strncasecmp(buf, "Range:", 6) == 0) {
+			request_parse_range(rq, buf + 6);
+		} else if (strncasecmp(buf, "If-None-Match:", 14) == 0) {
+			free(rq->if_none_match);
+			rq->if_none_match = Malloc(strlen(buf + 14) + 1);
+			strcpy(rq->if_none_match, buf + 14);
+		} else if (strncasecmp(buf, "If-Modified-Since:", 18) == 0) {
+			rq->if_modified_since = request_parse_date(buf + 18);
+		} else if (strncasecmp(buf, "Accept-Encoding:", 16) == 0) {
+			request_parse_encoding(rq, buf + 16);
+		}
 	}
 	return;
 }
@@ -74,10 +269,14 @@ request_read_headers(struct rio *rp)
  * Adding the "./" means that files will only be served from the directory in
  * which the webserver is running.
  *
- * Also, we don't serve files with a .. in the path (see request_readfile). */
-static void
+ * Also, we don't serve files with a .. in the path (see request_checkfile). */
+void
 request_parse_URI(char *uri, char *filename, size_t max)
 {
+	/* "/dir/file" and "dir/file" name the same file, and so should map to
+	 * the same cache entry */
+	while (*uri == '/')
+		uri++;
 	snprintf(filename, max, "./%s", uri);
 }
 
@@ -111,100 +310,536 @@ request_init(int connfd, struct file_data *data)
 	rq = Malloc(sizeof(struct request));
 	rq->fd = connfd;
 	rq->data = data;
+	rq->has_range = 0;
+	rq->range_first = -1;
+	rq->range_last = -1;
+	rq->if_none_match = NULL;
+	rq->if_modified_since = -1;
+	rq->accept_encoding = 0;
+	rq->status = 0;
+	rq->bytes_sent = 0;
+	rq->faulted = 0;
 	data->file_name = Malloc(MAXLINE);
 	data->file_buf = NULL;
 	data->file_size = 0;
+	data->file_mapped = 0;
+	data->file_304 = NULL;
+	data->file_zbuf = NULL;
+	data->file_zsize = 0;
 	rio = Rio_init(rq->fd);
 	Rio_readlineb(rio, buf, MAXLINE);
 	sscanf(buf, "%s %s %s", method, uri, version);
 
 	// printf("%s %s %s, fd = %d\n", method, uri, version, connfd);
 	if (strcasecmp(method, "GET")) {
-		request_error(rq->fd, method, "501", "Not Implemented",
+		request_error(rq, method, "501", "Not Implemented",
 			     "OS Web Server does not implement this method");
 		Rio_destroy(rio);
 		request_destroy(rq);
 		return NULL;
 	}
-	request_read_headers(rio);
+	request_read_headers(rq, rio);
 	request_parse_URI(uri, data->file_name, MAXLINE);
 	Rio_destroy(rio);
 	return rq;
 }
 
+/* the status of the response, once it is sent */
+int
+request_status(struct request *rq)
+{
+	return rq->status;
+}
+
+long
+request_bytes_sent(struct request *rq)
+{
+	return rq->bytes_sent;
+}
+
+/* copies size bytes of a mapping of the file of the request to dst.
+ * Returns 1 on success, 0 if the file was truncated, in which case an error
+ * is sent */
+int
+request_copymap(struct request *rq, void *dst, const void *src, long size)
+{
+	sigjmp_buf fault;
+
+	if (sigsetjmp(fault, 0)) {
+		request_guard_faulted(rq);
+		request_error(rq, rq->data->file_name, "404", "Not found",
+			      "OS Web Server could not read this file");
+		return 0;
+	}
+	request_fault = &fault;
+	memcpy(dst, src, size);
+	request_fault = NULL;
+	return 1;
+}
+
+/* Returns 1 if a mapping of the file faulted while the request was served,
+ * i.e., the file was truncated on disk, and its cached copies are bad */
+int
+request_map_faulted(struct request *rq)
+{
+	return rq->faulted;
+}
+
 void
 request_destroy(struct request *rq)
 {
 	assert(rq);
+	stats_request(rq->status, rq->bytes_sent);
 	/* close the connection fd */
 	SYS(close(rq->fd));
+	free(rq->if_none_match);
 	free(rq);
 }
 
+/* checks that file_name can be served, and fills meta with its size, mode and
+ * modification time. when the file can't be served, meta->status is the HTTP
+ * error and meta->error holds the preformatted error response, which should
+ * be freed by the caller.
+ * Returns 1 if the file can be served, 0 otherwise. */
+int
+request_checkfile(char *file_name, struct file_meta *meta)
+{
+	struct stat sbuf;
+	char *ext, *errnum, *shortmsg, *longmsg;
+	char buf[2 * MAXBUF];
+
+	meta->status = 404;
+	meta->size = 0;
+	meta->mode = 0;
+	meta->mtime = 0;
+	meta->error = NULL;
+	meta->error_size = 0;
+
+	errnum = "404";
+	shortmsg = "Not found";
+	/* don't serve files that start with /, or .., or end in .c */
+	if (file_name[0] == '/') {
+		/* this shouldn't really happen because we add a "./" at the
+		 * beginning of the file path */
+		longmsg = "OS Web Server doesn't serve files with absolute paths";
+	} else if (strstr(file_name, "..") != NULL) {
+		longmsg = "OS Web Server doesn't serve files with .. in the path";
+	} else if (((ext = strrchr(file_name, '.')) != NULL) && 
+		   ((strcmp(ext, ".c") == 0) || (strcmp(ext, ".h") == 0))) {
+		longmsg = "OS Web Server doesn't serve C or header files ";
+	} else if (stat(file_name, &sbuf) < 0) {
+		longmsg = "OS Web Server could not find this file";
+	} else {
+		meta->size = sbuf.st_size;
+		meta->mode = sbuf.st_mode;
+		meta->mtime = sbuf.st_mtime;
+		if ((S_ISREG(sbuf.st_mode)) && (S_IRUSR & sbuf.st_mode)) {
+			meta->status = 200;
+			return 1;
+		}
+		meta->status = 403;
+		errnum = "403";
+		shortmsg = "Forbidden";
+		longmsg = "OS Web Server could not read this file";
+	}
+
+	meta->error_size = request_format_error(buf, file_name, errnum,
+						 shortmsg, longmsg);
+	meta->error = Malloc(meta->error_size);
+	memcpy(meta->error, buf, meta->error_size);
+	return 0;
+}
+
+/* uses the result of request_checkfile for the request, filling
+ * rq->data->file_size without reading the file.
+ * Returns 1 on success.
+ * Returns 0 if the file can't be served, sends the error to client. */
+int
+request_setmeta(struct request *rq, struct file_meta *meta)
+{
+	struct file_data *data;
+
+	data = rq->data;
+	assert(data);
+
+	if (meta->status != 200) {
+		rq->status = meta->status;
+		request_write(rq, meta->error, meta->error_size);
+		return 0;
+	}
+	data->file_size = meta->size;
+	data->file_mtime = meta->mtime;
+	return 1;
+}
+
+/* checks that filename corresponding to request can be served, and fills
+ * rq->data->file_size without reading the file.
+ * Returns 1 on success.
+ * Returns 0 on failure, sends error to client. */
+int
+request_statfile(struct request *rq)
+{
+	struct file_meta meta;
+	int ret;
+
+	request_checkfile(rq->data->file_name, &meta);
+	ret = request_setmeta(rq, &meta);
+	free(meta.error);
+	return ret;
+}
+
+/* fills in the entity tag of the file and preformats the 304 response, so
+ * that revalidating a cached file needs no formatting at all */
+void
+request_set_etag(struct file_data *data)
+{
+	char date[64], buf[MAXLINE];
+	int size = 0;
+
+	snprintf(data->file_etag, sizeof(data->file_etag), "\"%x-%x-%lx\"",
+		 data->file_csum, data->file_size, (long)data->file_mtime);
+	request_format_date(data->file_mtime, date, sizeof(date));
+	size += sprintf(buf + size, "HTTP/1.0 304 Not Modified\r\n");
+	size += sprintf(buf + size, "Server: OS Web Server\r\n");
+	size += sprintf(buf + size, "ETag: %s\r\n", data->file_etag);
+	size += sprintf(buf + size, "Last-Modified: %s\r\n\r\n", date);
+	free(data->file_304);
+	data->file_304 = Malloc(size);
+	memcpy(data->file_304, buf, size);
+	data->file_304_size = size;
+}
+
+/* read in the file of data, which must have been checked with
+ * request_checkfile. the file is read into data->file_buf if it is not NULL,
+ * and it must then hold data->file_size bytes. data->file_csum is only
+ * computed if csum is set, otherwise the caller has filled it in.
+ * Returns 1 on success, and fills data->file_buf, and data->file_size.
+ * Returns 0 if the file can't be opened anymore. */
+int
+request_loaddata(struct file_data *data, int csum)
+{
+	int srcfd;
+	long off, chunk;
+	ssize_t n;
+
+	if (csum)
+		data->file_csum = 0;
+	if (data->file_size) {
+		if ((srcfd = open(data->file_name, O_RDONLY, 0)) < 0) {
+			/* removed since it was checked */
+			return 0;
+		}
+		/* the caller may have provided a buffer */
+		if (data->file_buf == NULL)
+			data->file_buf = Malloc(data->file_size);
+		/* generate a very trivial checksum as the file is read, while
+		 * each chunk is still in the cache */
+		for (off = 0; off < data->file_size; off += n) {
+			chunk = data->file_size - off;
+			if (chunk > REQUEST_READ_CHUNK)
+				chunk = REQUEST_READ_CHUNK;
+			n = Rio_read(srcfd, data->file_buf + off, chunk);
+			if (csum)
+				data->file_csum += csum_bytes(data->file_buf + off,
+							      n);
+			if (n < chunk) {
+				/* the file has shrunk since it was checked */
+				data->file_size = off + n;
+				break;
+			}
+		}
+		/* ask the kernel to stop caching the file */
+		SYS(posix_fadvise(srcfd, 0, data->file_size, 
+				  POSIX_FADV_DONTNEED));
+		SYS(close(srcfd));
+		/* we do this to simulate a slow disk. otherwise, file caching
+		 * doesn't have much benefit because a lot of the time is spent
+		 * in processing (see request_processfile below) and so
+		 * request_readfile does not have much impact. */
+		usleep(10000);
+	}
+	request_set_etag(data);
+	return 1;
+}
+
+/* read in the file corresponding to request, which must have been checked
+ * with request_statfile or request_setmeta, see request_loaddata.
+ * Returns 1 on success, and fills rq->file_buf, and rq->file_size.
+ * Returns 0 if the file can't be opened anymore, sends error to client. */
+int
+request_loadfile(struct request *rq)
+{
+	struct file_data *data;
+
+	data = rq->data;
+	assert(data);
+
+	if (!request_loaddata(data, 1)) {
+		request_error(rq, data->file_name, "404", "Not found",
+			      "OS Web Server could not find this file");
+		return 0;
+	}
+	return 1;
+}
+
 /* read in filename corresponding to request. 
  * Returns 1 on success, and fills rq->file_buf, and rq->file_size.
  * Returns 0 on failure, sends error to client. */
 int
 request_readfile(struct request *rq)
 {
-	int srcfd;
+	return request_statfile(rq) && request_loadfile(rq);
+}
+
+/* maps *size bytes at offset of the file of the request, read-only. the
+ * mapping shares the kernel's page cache, so the file is not copied, and its
+ * pages can be reclaimed under memory pressure. *size is cut down if the
+ * file has shrunk since it was checked, so the mapping never extends past
+ * the end of the file.
+ * Returns the mapping, or NULL if the file could not be mapped, in which
+ * case an error is sent. */
+static char *
+request_map(struct request *rq, long offset, int *size)
+{
+	int srcfd, flags = MAP_SHARED;
 	struct stat sbuf;
+	char *buf;
+
+	if ((srcfd = open(rq->data->file_name, O_RDONLY, 0)) < 0) {
+		request_error(rq, rq->data->file_name, "404", "Not found",
+			      "OS Web Server could not find this file");
+		return NULL;
+	}
+	SYS(fstat(srcfd, &sbuf));
+	if (offset + *size > sbuf.st_size)
+		*size = sbuf.st_size > offset ? sbuf.st_size - offset : 0;
+	if (*size <= REQUEST_POPULATE_MAX)
+		flags |= MAP_POPULATE;
+	buf = *size ? mmap(NULL, *size, PROT_READ, flags, srcfd, offset) :
+		MAP_FAILED;
+	SYS(close(srcfd));
+	if (buf == MAP_FAILED) {
+		request_error(rq, rq->data->file_name, "404", "Not found",
+			      "OS Web Server could not read this file");
+		return NULL;
+	}
+	if (!(flags & MAP_POPULATE))
+		madvise(buf, *size, MADV_WILLNEED);
+	/* simulate a slow disk, see request_readfile */
+	usleep(10000);
+	return buf;
+}
+
+/* like request_loadfile, but maps the file instead of reading it in.
+ * Returns 1 on success, and fills rq->file_buf, and rq->file_size.
+ * Returns 0 if the file can't be mapped anymore, sends error to client. */
+int
+request_mapfile(struct request *rq)
+{
 	struct file_data *data;
-	char *ext;
+	sigjmp_buf fault;
 
 	data = rq->data;
 	assert(data);
 
-	/* don't serve files that start with /, or .., or end in .c */
-	if (data->file_name[0] == '/') {
-		/* this shouldn't really happen because we add a "./" at the
-		 * beginning of the file path */
-		request_error(rq->fd, data->file_name, "404", "Not found",
-			      "OS Web Server doesn't serve files "
-			      "with absolute paths");
+	data->file_csum = 0;
+	if (data->file_size) {
+		data->file_buf = request_map(rq, 0, &data->file_size);
+		if (data->file_buf == NULL)
+			return 0;
+		data->file_mapped = 1;
+		if (sigsetjmp(fault, 0)) {
+			request_guard_faulted(rq);
+			request_error(rq, data->file_name, "404", "Not found",
+				      "OS Web Server could not read this file");
+			return 0;
+		}
+		request_fault = &fault;
+		data->file_csum = csum_bytes(data->file_buf, data->file_size);
+		request_fault = NULL;
+	}
+	request_set_etag(data);
+	return 1;
+}
+
+/* compresses data->file_buf into data->file_zbuf as a raw deflate stream.
+ * the gzip and zlib (deflate) wrappers are added when the file is sent, so a
+ * single compressed copy serves both codings.
+ * Returns 1 if the file was compressed, 0 if compression doesn't pay. */
+int
+request_compressfile(struct file_data *data)
+{
+	z_stream zs;
+	uLong bound;
+	sigjmp_buf fault;
+	char *zbuf;
+
+	if (data->file_size == 0 || data->file_zbuf != NULL) {
 		return 0;
 	}
-	if (strstr(data->file_name, "..") != NULL) {
-		request_error(rq->fd, data->file_name, "404", "Not found",
-			      "OS Web Server doesn't serve files "
-			      "with .. in the path");
+	memset(&zs, 0, sizeof(zs));
+	if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8,
+			 Z_DEFAULT_STRATEGY) != Z_OK) {
 		return 0;
 	}
-	if (((ext = strrchr(data->file_name, '.')) != NULL) && 
-	    ((strcmp(ext, ".c") == 0) || (strcmp(ext, ".h") == 0))) {
-		request_error(rq->fd, data->file_name, "404", "Not found",
-			      "OS Web Server doesn't serve C or header files ");
+	bound = deflateBound(&zs, data->file_size);
+	data->file_zbuf = Malloc(bound);
+	if (sigsetjmp(fault, 0)) {
+		/* the file is sent uncompressed, which fails as well */
+		request_fault = NULL;
+		deflateEnd(&zs);
+		free(data->file_zbuf);
+		data->file_zbuf = NULL;
 		return 0;
 	}
+	request_fault = &fault;
+	zs.next_in = (Bytef *)data->file_buf;
+	zs.avail_in = data->file_size;
+	zs.next_out = (Bytef *)data->file_zbuf;
+	zs.avail_out = bound;
+	if (deflate(&zs, Z_FINISH) != Z_STREAM_END ||
+	    zs.total_out >= data->file_size) {
+		request_fault = NULL;
+		deflateEnd(&zs);
+		free(data->file_zbuf);
+		data->file_zbuf = NULL;
+		return 0;
+	}
+	data->file_zsize = zs.total_out;
+	deflateEnd(&zs);
+	/* give back the unused part of the bound, if realloc can */
+	if ((zbuf = realloc(data->file_zbuf, data->file_zsize)) != NULL)
+		data->file_zbuf = zbuf;
+	data->file_zcsum = csum_bytes(data->file_zbuf, data->file_zsize);
+	data->file_crc32 = crc32(0L, (Bytef *)data->file_buf, data->file_size);
+	data->file_adler32 = adler32(1L, (Bytef *)data->file_buf,
+				     data->file_size);
+	request_fault = NULL;
+	return 1;
+}
 
-	if (stat(data->file_name, &sbuf) < 0) {
-		request_error(rq->fd, data->file_name, "404", "Not found",
-			      "OS Web Server could not find this file");
+/* inflates data->file_zbuf, made by request_compressfile, into buf, which
+ * must hold data->file_size bytes.
+ * Returns 1 on success, 0 if the stream does not hold the file. */
+int
+request_decompressfile(struct file_data *data, char *buf)
+{
+	z_stream zs;
+	int ret;
+
+	memset(&zs, 0, sizeof(zs));
+	if (inflateInit2(&zs, -MAX_WBITS) != Z_OK) {
 		return 0;
 	}
-	if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
-		request_error(rq->fd, data->file_name, "403", "Forbidden",
+	zs.next_in = (Bytef *)data->file_zbuf;
+	zs.avail_in = data->file_zsize;
+	zs.next_out = (Bytef *)buf;
+	zs.avail_out = data->file_size;
+	ret = inflate(&zs, Z_FINISH);
+	inflateEnd(&zs);
+	return ret == Z_STREAM_END && zs.total_out == data->file_size;
+}
+
+/* like request_readblock, but maps the block instead of reading it in. offset
+ * must be a multiple of the page size. */
+int
+request_mapblock(struct request *rq, struct file_data *block, long offset,
+		 int size)
+{
+	int n = size;
+
+	assert(rq->data && block);
+	if ((block->file_buf = request_map(rq, offset, &n)) == NULL)
+		return 0;
+	block->file_mapped = 1;
+	block->file_size = n;
+	if (n != size) {
+		/* the file was truncated under us */
+		request_error(rq, rq->data->file_name, "404", "Not found",
 			      "OS Web Server could not read this file");
 		return 0;
 	}
+	return 1;
+}
 
-	data->file_size = sbuf.st_size;
+/* read size bytes at offset of the file corresponding to request into
+ * block->file_buf, which is allocated unless the caller provided it. the file
+ * must have been checked with request_statfile.
+ * Returns 1 on success, 0 if the file could not be read (it may have been
+ * removed since it was checked), in which case an error is sent. */
+int
+request_readblock(struct request *rq, struct file_data *block, long offset,
+		  int size)
+{
+	int srcfd;
+	ssize_t n;
 
-	if (data->file_size) {
-		SYS(srcfd = open(data->file_name, O_RDONLY, 0));
-		data->file_buf = Malloc(data->file_size);
-		Rio_read(srcfd, data->file_buf, data->file_size);
-		/* ask the kernel to stop caching the file */
-		SYS(posix_fadvise(srcfd, 0, data->file_size, 
-				  POSIX_FADV_DONTNEED));
-		SYS(close(srcfd));
-		/* we do this to simulate a slow disk. otherwise, file caching
-		 * doesn't have much benefit because a lot of the time is spent
-		 * in processing (see request_processfile below) and so
-		 * request_readfile does not have much impact. */
-		usleep(10000);
+	assert(rq->data && block);
+	if ((srcfd = open(rq->data->file_name, O_RDONLY, 0)) < 0) {
+		request_error(rq, rq->data->file_name, "404", "Not found",
+			      "OS Web Server could not find this file");
+		return 0;
+	}
+	SYS(lseek(srcfd, offset, SEEK_SET));
+	if (block->file_buf == NULL)
+		block->file_buf = Malloc(size);
+	n = Rio_read(srcfd, block->file_buf, size);
+	block->file_size = n;
+	SYS(posix_fadvise(srcfd, offset, size, POSIX_FADV_DONTNEED));
+	SYS(close(srcfd));
+	/* simulate a slow disk, see request_readfile */
+	usleep(10000);
+	if (n != size) {
+		/* the file was truncated under us */
+		block->file_size = 0;
+		request_error(rq, rq->data->file_name, "404", "Not found",
+			      "OS Web Server could not read this file");
+		return 0;
+	}
+	return 1;
+}
+
+/* resolves the Range: header of the request against a file of the given size.
+ * Returns 1 and fills first and last (inclusive) if a range should be sent.
+ * Returns 0 if the request has no range, so the whole file should be sent.
+ * Returns -1 if the range can't be satisfied, sends error to client. */
+int
+request_range(struct request *rq, long size, long *first, long *last)
+{
+	if (!rq->has_range) {
+		return 0;
+	}
+	if (rq->range_first < 0) {
+		/* suffix range */
+		if (rq->range_last == 0 || size == 0) {
+			goto unsatisfiable;
+		}
+		*first = (rq->range_last >= size) ? 0 : size - rq->range_last;
+		*last = size - 1;
+		return 1;
+	}
+	if (rq->range_first >= size) {
+		goto unsatisfiable;
+	}
+	*first = rq->range_first;
+	if (rq->range_last < 0 || rq->range_last >= size) {
+		*last = size - 1;
+	} else {
+		*last = rq->range_last;
 	}
 	return 1;
+
+unsatisfiable:
+	request_error(rq, rq->data->file_name, "416",
+		      "Range Not Satisfiable",
+		      "OS Web Server could not satisfy the requested range");
+	return -1;
+}
+
+int
+request_has_range(struct request *rq)
+{
+	return rq->has_range;
 }
 
 /* if you have previous file data, you can reuse it */
@@ -214,57 +849,337 @@ request_set_data(struct request *rq, struct file_data *data)
 	rq->data = data;
 }
 
+/* Returns 1 if rq->data is sent to the client compressed */
+static int
+request_encoded(struct request *rq)
+{
+	return rq->data->file_zbuf != NULL && rq->accept_encoding != 0;
+}
+
+/* formats the entity tag of the representation of rq->data that is sent to
+ * the client into etag. A compressed copy has a tag of its own, that of the
+ * file with a suffix for the coding, since it is not the same bytes */
+static void
+request_format_etag(struct request *rq, char *etag, size_t max)
+{
+	struct file_data *data = rq->data;
+	int len = strlen(data->file_etag);
+
+	if (!request_encoded(rq)) {
+		snprintf(etag, max, "%s", data->file_etag);
+		return;
+	}
+	/* the suffix goes inside the closing quote */
+	snprintf(etag, max, "%.*s-%s\"", len - 1, data->file_etag,
+		 (rq->accept_encoding & ENCODING_GZIP) ? "gz" : "df");
+}
+
+/* checks the conditional headers of the request against the entity tag and
+ * modification time of rq->data. If-None-Match takes precedence over
+ * If-Modified-Since.
+ * Returns 1 if the client's copy is current, so a 304 can be sent. */
+int
+request_not_modified(struct request *rq)
+{
+	struct file_data *data = rq->data;
+	char etag[64];
+
+	assert(data);
+	if (rq->if_none_match) {
+		char *p = rq->if_none_match;
+
+		while (isspace(*p))
+			p++;
+		if (*p == '*')
+			return 1;
+		/* the header may hold a list of (possibly weak) tags */
+		request_format_etag(rq, etag, sizeof(etag));
+		return strstr(p, etag) != NULL;
+	}
+	if (rq->if_modified_since >= 0) {
+		return data->file_mtime <= rq->if_modified_since;
+	}
+	return 0;
+}
+
+/* send the preformatted 304 response of rq->data, or format one with the
+ * tag of the compressed copy */
+void
+request_send_not_modified(struct request *rq)
+{
+	char buf[MAXLINE], etag[64], date[64];
+	long start = stats_now();
+	int size = 0;
+
+	assert(rq->data && rq->data->file_304);
+	rq->status = 304;
+	if (!request_encoded(rq)) {
+		request_write(rq, rq->data->file_304, rq->data->file_304_size);
+		stats_record(STATS_STAGE_SEND, stats_now() - start);
+		return;
+	}
+	request_format_etag(rq, etag, sizeof(etag));
+	request_format_date(rq->data->file_mtime, date, sizeof(date));
+	size += sprintf(buf + size, "HTTP/1.0 304 Not Modified\r\n");
+	size += sprintf(buf + size, "Server: OS Web Server\r\n");
+	size += sprintf(buf + size, "Vary: Accept-Encoding\r\n");
+	size += sprintf(buf + size, "ETag: %s\r\n", etag);
+	size += sprintf(buf + size, "Last-Modified: %s\r\n\r\n", date);
+	request_write(rq, buf, size);
+	stats_record(STATS_STAGE_SEND, stats_now() - start);
+}
+
 /* process file, the main reason for this function is that if we don't do enough
  * processing on the file, the network becomes the bottleneck, and then the
  * various server parameters have no affect on server performance. this is a
  * problem because we have 100 Mb/s network. With faster networks, we wouldn't
- * have to do this artificial work. */
+ * have to do this artificial work.
+ * Returns the checksum of buf. */
+static unsigned int
+request_processfile(char *buf, long size)
+{
+	/* the checksum of the buffer comes out of the first pass */
+	return csum_process(buf, size, 128);
+}
+
+/* stores v in little-endian order, as needed by the gzip trailer */
 static void
-request_processfile(struct request *rq)
+request_put_le32(unsigned char *p, unsigned long v)
+{
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+	p[2] = (v >> 16) & 0xff;
+	p[3] = (v >> 24) & 0xff;
+}
+
+/* send the compressed copy of rq->data, wrapped for the coding the client
+ * accepts. gzip is preferred over deflate. */
+static void
+request_sendfile_compressed(struct request *rq, char *filetype, char *date)
+{
+	unsigned char head[10], tail[8];
+	int head_size, tail_size, i;
+	unsigned int csum;
+	char buf[MAXBUF], etag[64];
+	struct file_data *data = rq->data;
+	const char *coding;
+	long size = 0;
+
+	if (rq->accept_encoding & ENCODING_GZIP) {
+		/* magic, deflate, no flags, no mtime, no xflags, unix */
+		static const unsigned char gzip_head[10] = {
+			0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+		memcpy(head, gzip_head, sizeof(gzip_head));
+		head_size = sizeof(gzip_head);
+		request_put_le32(tail, data->file_crc32);
+		request_put_le32(tail + 4, data->file_size);
+		tail_size = 8;
+		coding = "gzip";
+	} else {
+		/* 32K window, default compression level */
+		head[0] = 0x78;
+		head[1] = 0x9c;
+		head_size = 2;
+		tail[0] = (data->file_adler32 >> 24) & 0xff;
+		tail[1] = (data->file_adler32 >> 16) & 0xff;
+		tail[2] = (data->file_adler32 >> 8) & 0xff;
+		tail[3] = data->file_adler32 & 0xff;
+		tail_size = 4;
+		coding = "deflate";
+	}
+	/* the checksum covers the bytes that are actually sent */
+	csum = data->file_zcsum;
+	for (i = 0; i < head_size; i++) {
+		csum += head[i];
+	}
+	for (i = 0; i < tail_size; i++) {
+		csum += tail[i];
+	}
+
+	size += sprintf(buf + size, "HTTP/1.0 200 OK\r\n");
+	size += sprintf(buf + size, "Server: OS Web Server\r\n");
+	size += sprintf(buf + size, "Content-Type: %s\r\n", filetype);
+	size += sprintf(buf + size, "Content-Encoding: %s\r\n", coding);
+	size += sprintf(buf + size, "Vary: Accept-Encoding\r\n");
+	size += sprintf(buf + size, "Content-Length: %d\r\n",
+			head_size + data->file_zsize + tail_size);
+	request_format_etag(rq, etag, sizeof(etag));
+	size += sprintf(buf + size, "ETag: %s\r\n", etag);
+	size += sprintf(buf + size, "Last-Modified: %s\r\n", date);
+	size += sprintf(buf + size, "Content-Csum: %u\r\n\r\n", csum);
+	/* the gzip/zlib header goes out with the response header */
+	memcpy(buf + size, head, head_size);
+	size += head_size;
+
+	rq->status = 200;
+	request_write(rq, buf, size);
+	request_write(rq, data->file_zbuf, data->file_zsize);
+	request_write(rq, tail, tail_size);
+}
+
+/* formats the header of the response that sends data in full, without
+ * compression, into buf, which must hold MAXBUF bytes. data->file_etag must
+ * be filled in, see request_set_etag.
+ * Returns the size of the header. */
+int
+request_format_header(struct file_data *data, char *buf)
+{
+	char filetype[MAXLINE], date[64];
+	int size = 0;
+
+	request_get_file_type(data->file_name, filetype);
+	request_format_date(data->file_mtime, date, sizeof(date));
+	size += sprintf(buf + size, "HTTP/1.0 200 OK\r\n");
+	size += sprintf(buf + size, "Server: OS Web Server\r\n");
+	size += sprintf(buf + size, "Content-Type: %s\r\n", filetype);
+	size += sprintf(buf + size, "Content-Length: %d\r\n", data->file_size);
+	size += sprintf(buf + size, "ETag: %s\r\n", data->file_etag);
+	size += sprintf(buf + size, "Last-Modified: %s\r\n", date);
+	size += sprintf(buf + size, "Content-Csum: %u\r\n\r\n", data->file_csum);
+	return size;
+}
+
+/* send rq->data in full to the fd connection, after the header that
+ * request_format_header formatted for it, which may have been formatted
+ * long before, e.g., by the packer of a bundle */
+void
+request_sendfile_header(struct request *rq, const char *header,
+			int header_size)
 {
 	struct file_data *data;
-	int i, j, dummy;
+	sigjmp_buf fault;
+	long start;
+
 	data = rq->data;
 	assert(data);
 
-	for (i = 0; i < 128; i++) {
-		for (j = 0; j < data->file_size; j++) {
-			dummy += (unsigned char)(data->file_buf[j]);
-		}
+	if (sigsetjmp(fault, 0)) {
+		/* the client sees a short response if the header was sent */
+		request_guard_faulted(rq);
+		if (rq->status == 0)
+			request_error(rq, data->file_name, "404", "Not found",
+				      "OS Web Server could not read this file");
+		return;
+	}
+	request_fault = &fault;
+	/* the checksum was generated when the file was read */
+	/* do some processing */
+	start = stats_now();
+	request_processfile(data->file_buf, data->file_size);
+	stats_record(STATS_STAGE_PROCESS, stats_now() - start);
+	start = stats_now();
+	rq->status = 200;
+	request_write(rq, header, header_size);
+
+	/* writes data->file_buf to the client socket */
+	if (data->file_size > 0) {
+		request_write(rq, data->file_buf, data->file_size);
 	}
+	request_fault = NULL;
+	stats_record(STATS_STAGE_SEND, stats_now() - start);
 }
 
 /* send filename to the fd connection */
 void
 request_sendfile(struct request *rq)
 {
-	char filetype[MAXLINE], buf[MAXBUF];
-	int i;
-	unsigned int csum = 0;
+	char filetype[MAXLINE], buf[MAXBUF], date[64];
 	struct file_data *data;
-	long size = 0;
+	sigjmp_buf fault;
+	long start;
 
 	data = rq->data;
 	assert(data);
 
+	if (!request_encoded(rq)) {
+		request_sendfile_header(rq, buf,
+					request_format_header(data, buf));
+		return;
+	}
 	request_get_file_type(data->file_name, filetype);
-	/* generate a very trivial checksum */
-	for (i = 0; i < data->file_size; i++) {
-		csum += (unsigned char)(data->file_buf[i]);
+	request_format_date(data->file_mtime, date, sizeof(date));
+	if (sigsetjmp(fault, 0)) {
+		request_guard_faulted(rq);
+		request_error(rq, data->file_name, "404", "Not found",
+			      "OS Web Server could not read this file");
+		return;
 	}
+	request_fault = &fault;
 	/* do some processing */
-	request_processfile(rq);
-	/* put together response */
-	size += sprintf(buf + size, "HTTP/1.0 200 OK\r\n");
-	size += sprintf(buf + size, "Server: OS Web Server\r\n");
-	size += sprintf(buf + size, "Content-Type: %s\r\n", filetype);
-	size += sprintf(buf + size, "Content-Length: %d\r\n", data->file_size);
-	size += sprintf(buf + size, "Content-Csum: %u\r\n\r\n", csum);
+	start = stats_now();
+	request_processfile(data->file_buf, data->file_size);
+	request_fault = NULL;
+	stats_record(STATS_STAGE_PROCESS, stats_now() - start);
+	start = stats_now();
+	request_sendfile_compressed(rq, filetype, date);
+	stats_record(STATS_STAGE_SEND, stats_now() - start);
+}
 
-	Rio_write(rq->fd, buf, strlen(buf));
+/* send bytes first to last (inclusive) of the file to the fd connection as a
+ * partial response. buf holds exactly these bytes, and rq->data->file_size
+ * must be the size of the whole file. */
+void
+request_sendrange(struct request *rq, char *buf, long first, long last)
+{
+	char filetype[MAXLINE], hdr[MAXBUF];
+	long len = last - first + 1;
+	unsigned int csum;
+	struct file_data *data;
+	sigjmp_buf fault;
+	long size = 0, start;
 
-	/* writes data->file_buf to the client socket */
-	if (data->file_size > 0) {
-		Rio_write(rq->fd, data->file_buf, data->file_size);
+	data = rq->data;
+	assert(data);
+
+	request_get_file_type(data->file_name, filetype);
+	if (sigsetjmp(fault, 0)) {
+		request_guard_faulted(rq);
+		if (rq->status == 0)
+			request_error(rq, data->file_name, "404", "Not found",
+				      "OS Web Server could not read this file");
+		return;
 	}
+	request_fault = &fault;
+	/* do some processing. the checksum covers the bytes that are actually
+	 * sent, so it is generated along with the processing */
+	start = stats_now();
+	csum = request_processfile(buf, len);
+	stats_record(STATS_STAGE_PROCESS, stats_now() - start);
+	start = stats_now();
+	size += sprintf(hdr + size, "HTTP/1.0 206 Partial Content\r\n");
+	size += sprintf(hdr + size, "Server: OS Web Server\r\n");
+	size += sprintf(hdr + size, "Content-Type: %s\r\n", filetype);
+	size += sprintf(hdr + size, "Content-Range: bytes %ld-%ld/%d\r\n",
+			first, last, data->file_size);
+	size += sprintf(hdr + size, "Content-Length: %ld\r\n", len);
+	size += sprintf(hdr + size, "Content-Csum: %u\r\n\r\n", csum);
+
+	rq->status = 206;
+	request_write(rq, hdr, size);
+	if (len > 0) {
+		request_write(rq, buf, len);
+	}
+	request_fault = NULL;
+	stats_record(STATS_STAGE_SEND, stats_now() - start);
+}
+
+/* send a response that the server generated, e.g., its metrics. the body is
+ * not cached, so it is not processed either */
+void
+request_sendbody(struct request *rq, char *type, char *body, int body_size)
+{
+	char hdr[MAXBUF];
+	long size = 0;
+
+	size += sprintf(hdr + size, "HTTP/1.0 200 OK\r\n");
+	size += sprintf(hdr + size, "Server: OS Web Server\r\n");
+	size += sprintf(hdr + size, "Content-Type: %s\r\n", type);
+	size += sprintf(hdr + size, "Cache-Control: no-store\r\n");
+	size += sprintf(hdr + size, "Content-Length: %d\r\n", body_size);
+	size += sprintf(hdr + size, "Content-Csum: %u\r\n\r\n",
+			csum_bytes(body, body_size));
+
+	rq->status = 200;
+	request_write(rq, hdr, size);
+	request_write(rq, body, body_size);
 }
@@ -1,16 +1,72 @@
 #ifndef __REQUEST_H__
 #define __REQUEST_H__
 
+#include <time.h>
+#include <sys/types.h>
+
+struct content;
+
 struct file_data {
 	char *file_name; /* name of file being requested */
 	char *file_buf;	 /* file is read into this buffer in memory */
 	int file_size;	 /* file size */
+	int file_mapped; /* file_buf is a read-only mapping of the file */
+	struct content *file_content; /* shared contents, see content.c */
+	unsigned int file_csum;	/* checksum of file_buf */
+	time_t file_mtime;	/* last modification time of the file */
+	char file_etag[32];	/* entity tag, derived from csum, size and mtime */
+	char *file_304;	 /* preformatted 304 Not Modified response */
+	int file_304_size;
+	char *file_zbuf; /* raw deflate stream of file_buf, or NULL */
+	int file_zsize;
+	unsigned int file_zcsum;	/* checksum of file_zbuf */
+	unsigned long file_crc32;	/* of file_buf, for the gzip trailer */
+	unsigned long file_adler32;	/* of file_buf, for the zlib trailer */
+};
+
+/* what request_checkfile found out about a file */
+struct file_meta {
+	int status;	 /* 200 if the file can be served, else the HTTP error */
+	off_t size;
+	mode_t mode;
+	time_t mtime;
+	char *error;	 /* preformatted error response, when status != 200 */
+	int error_size;
 };
 
 struct request *request_init(int connfd, struct file_data *data);
+void request_parse_URI(char *uri, char *filename, size_t max);
+int request_checkfile(char *file_name, struct file_meta *meta);
+int request_setmeta(struct request *rq, struct file_meta *meta);
+int request_statfile(struct request *rq);
+int request_loaddata(struct file_data *data, int csum);
+int request_loadfile(struct request *rq);
 int request_readfile(struct request *rq);
+int request_mapfile(struct request *rq);
+void request_set_etag(struct file_data *data);
+int request_compressfile(struct file_data *data);
+int request_decompressfile(struct file_data *data, char *buf);
+int request_mapblock(struct request *rq, struct file_data *block, long offset,
+		     int size);
+int request_readblock(struct request *rq, struct file_data *block, long offset,
+		      int size);
+int request_has_range(struct request *rq);
+int request_range(struct request *rq, long size, long *first, long *last);
 void request_set_data(struct request *rq, struct file_data *data);
+int request_not_modified(struct request *rq);
+void request_send_not_modified(struct request *rq);
+int request_format_header(struct file_data *data, char *buf);
+void request_sendfile_header(struct request *rq, const char *header,
+			     int header_size);
 void request_sendfile(struct request *rq);
+void request_sendbody(struct request *rq, char *type, char *body,
+		      int body_size);
+void request_sendrange(struct request *rq, char *buf, long first, long last);
+int request_status(struct request *rq);
+long request_bytes_sent(struct request *rq);
+void request_guard_init(void);
+int request_copymap(struct request *rq, void *dst, const void *src, long size);
+int request_map_faulted(struct request *rq);
 void request_destroy(struct request *rq);
 
 #endif
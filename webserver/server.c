@@ -1,29 +1,106 @@
 #include <malloc.h>
+#include <limits.h>
+#include <popt.h>
 #include "common.h"
 #include "request.h"
 #include "server_thread.h"
+#include "handoff.h"
+#include "watch.h"
 
 /* 
  * server.c: A very, very simple web server
  *
  * To run:
- *  server portnum nr_threads max_requests max_cache_size
+ *  server [options] portnum nr_threads max_requests max_cache_size
  *
  * Repeatedly handles HTTP requests sent to this port number. Most of the work
  * is done within routines written in server_thread.c and request.c
+ *
+ * To restart without dropping connections or the cache:
+ *  server --takeover [options] portnum nr_threads max_requests max_cache_size
  */
 
+#define DEFAULT_SPILL_SIZE 1024
+
+poptContext context;	/* context for parsing command-line options */
+
 static void
-usage(char *program)
+usage(void)
 {
-	fprintf(stderr, "Usage: %s port nr_threads max_requests "
-		"max_cache_size\n", program);
+	poptPrintUsage(context, stderr, 0);
 	exit(1);
 }
 
+/* the next positional argument, as an int */
+static int
+next_arg(void)
+{
+	const char *arg = poptGetArg(context);
+
+	if (arg == NULL)
+		usage();
+	return atoi(arg);
+}
+
+/* parses a size in bytes, with an optional k, m, g or t suffix.
+ * Returns the size, or -1 if arg is not a size */
+static long long
+parse_size(const char *arg)
+{
+	char *end;
+	long long size;
+
+	errno = 0;
+	size = strtoll(arg, &end, 10);
+	if (errno != 0 || end == arg || size < 0)
+		return -1;
+	switch (*end) {
+	case 't': case 'T': size *= 1024;	/* fall through */
+	case 'g': case 'G': size *= 1024;	/* fall through */
+	case 'm': case 'M': size *= 1024;	/* fall through */
+	case 'k': case 'K': size *= 1024; end++;
+	}
+	return *end == '\0' ? size : -1;
+}
+
+/* parses a count, e.g., of threads.
+ * Returns the count, or -1 if arg is not a count */
+static int
+parse_count(const char *arg)
+{
+	char *end;
+	long count;
+
+	errno = 0;
+	count = strtol(arg, &end, 10);
+	if (errno != 0 || end == arg || *end != '\0' || count < 0 ||
+	    count > INT_MAX)
+		return -1;
+	return count;
+}
+
+/* the next positional argument, as a size */
+static long long
+next_size_arg(void)
+{
+	const char *arg = poptGetArg(context);
+
+	if (arg == NULL)
+		usage();
+	return parse_size(arg);
+}
+
 static char *fifo = "./server_exit";
 
-/* we will use this fifo to send a message to the server to exit */
+/* we will use this fifo to send commands to the server, one per line:
+ *   threads N		resize the worker pool
+ *   requests N		resize the request queue
+ *   cache N		resize the cache, in bytes, or with a k, m, g suffix
+ *   policy lru|fifo	switch the eviction policy of the cache
+ *   purge [PATH]	drop PATH, or every file, from the caches
+ *   trace		write out the trace, see --trace
+ *   shutdown		exit
+ * anything else makes the server exit as well */
 static int
 open_fifo(void)
 {
@@ -52,45 +129,242 @@ close_fifo(void)
 	unlink(fifo);
 }
 
+/* runs a command written to the fifo.
+ * Returns 1 if the server should exit, 0 otherwise. */
+static int
+run_command(struct server *sv, char *line)
+{
+	char cmd[MAXLINE], arg[MAXLINE];
+	int n, ret;
+
+	n = sscanf(line, "%s %s", cmd, arg);
+	if (n < 1) {
+		return 0;
+	}
+	if (strcmp(cmd, "threads") == 0 && n == 2) {
+		ret = server_set_threads(sv, parse_count(arg));
+	} else if (strcmp(cmd, "requests") == 0 && n == 2) {
+		ret = server_set_requests(sv, parse_count(arg));
+	} else if (strcmp(cmd, "cache") == 0 && n == 2) {
+		ret = server_set_cache(sv, parse_size(arg));
+	} else if (strcmp(cmd, "policy") == 0 && n == 2) {
+		ret = server_set_policy(sv, arg);
+	} else if (strcmp(cmd, "purge") == 0) {
+		server_purge(sv, n == 2 ? arg : NULL);
+		ret = 1;
+	} else if (strcmp(cmd, "trace") == 0) {
+		server_trace(sv);
+		ret = 1;
+	} else {
+		/* shutdown, or anything else */
+		return 1;
+	}
+	if (!ret) {
+		fprintf(stderr, "%s: %s: invalid argument\n", fifo, line);
+	}
+	return 0;
+}
+
+/* reads the commands written to the fifo, and runs them.
+ * Returns 1 if the server should exit, 0 otherwise. */
+static int
+read_fifo(struct server *sv, int *fd)
+{
+	char buf[MAXLINE];
+	char *line, *next;
+	int n;
+
+	SYS(n = read(*fd, buf, sizeof(buf) - 1));
+	if (n == 0) {
+		/* the writer closed its end, so wait for the next one. until
+		 * then, the fifo would keep polling as hung up */
+		SYS(close(*fd));
+		SYS(*fd = open(fifo, O_RDONLY | O_NONBLOCK));
+		return 0;
+	}
+	buf[n] = '\0';
+	for (line = buf; line != NULL && *line != '\0'; line = next) {
+		if ((next = strchr(line, '\n')) != NULL)
+			*next++ = '\0';
+		if (run_command(sv, line)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
 int
 main(int argc, char *argv[])
 {
-	int port, nr_threads, max_requests, max_cache_size;
+	int port, nr_threads, max_requests;
+	long long max_cache_size;
 	int listenfd, connfd, clientlen;
-	int exitfd;
+	int exitfd, ctlfd;
+	int takeover = 0, handed_off = 0;
 	struct sockaddr_in clientaddr;
 	struct server *sv;
+	struct server_options opts;
+	int c;
+	struct poptOption options_table[] = {
+		{"mmap", 'M', POPT_ARG_NONE, &opts.cache_mmap, 0,
+		 "cache read-only mappings of files instead of copies", NULL},
+		{"mlock", 'L', POPT_ARG_INT, &opts.max_locked_size, 0,
+		 "bytes of hot mapped files to lock in memory",
+		 " default: 0"},
+		{"gzip", 'z', POPT_ARG_NONE, &opts.compress, 0,
+		 "keep a compressed copy of cached files, for clients that "
+		 "accept gzip or deflate", NULL},
+		{"cold", 'C', POPT_ARG_INT, &opts.cold_percent, 0,
+		 "percent of the cache that keeps files compressed, which "
+		 "implies --gzip", " default: 0"},
+		{"dedup", 0, POPT_ARG_NONE, &opts.dedup, 0,
+		 "keep the contents of identical files in the cache once",
+		 NULL},
+		{"admission", 0, POPT_ARG_NONE, &opts.admission, 0,
+		 "only evict files for files that are requested more often",
+		 NULL},
+		{"doorkeeper", 0, POPT_ARG_NONE, &opts.doorkeeper, 0,
+		 "with --admission, count files from their second request",
+		 NULL},
+		{"cgroup", 0, POPT_ARG_STRING, &opts.cgroup_path, 0,
+		 "cgroup v2 directory, e.g., /sys/fs/cgroup, whose memory "
+		 "pressure shrinks the cache, and grows it back", NULL},
+		{"ttl", 0, POPT_ARG_INT, &opts.ttl, 0,
+		 "seconds that cached files are served without checking "
+		 "whether they changed", " default: 0, for ever"},
+		{"stale", 0, POPT_ARG_INT, &opts.stale, 0,
+		 "seconds after the ttl that they are still served, while "
+		 "they are checked in the background", " default: the ttl"},
+		{"mrc", 0, POPT_ARG_INT, &opts.mrc_rate, 0,
+		 "estimate the hit ratio of other cache sizes from one in N "
+		 "files, served at /__mrc", " default: 0, off"},
+		{"reclaim", 0, POPT_ARG_INT, &opts.reclaim_percent, 0,
+		 "percent of the cache that a background thread keeps free",
+		 " default: 0"},
+		{"reclaim-low", 0, POPT_ARG_INT, &opts.reclaim_low_percent, 0,
+		 "percent of free space below which it evicts files",
+		 " default: half of --reclaim"},
+		{"spill", 'S', POPT_ARG_STRING, &opts.spill_path, 0,
+		 "file, or directory, on a local disk that caches files "
+		 "evicted from memory", NULL},
+		{"spill-size", 0, POPT_ARG_INT, &opts.spill_size, 0,
+		 "size of the spill file in MB",
+		 " default: " STR(DEFAULT_SPILL_SIZE)},
+		{"access-log", 'A', POPT_ARG_STRING, &opts.access_log, 0,
+		 "file that a line is appended to for every request", NULL},
+		{"trace", 'T', POPT_ARG_STRING, &opts.trace_path, 0,
+		 "trace the server, and write the trace to this file on exit "
+		 "or when \"trace\" is written to the fifo", NULL},
+		{"snapshot", 0, POPT_ARG_STRING, &opts.snapshot_path, 0,
+		 "file that lists the cached files on exit, from which the "
+		 "cache is warmed up on start", NULL},
+		{"preload", 0, POPT_ARG_STRING, &opts.preload_path, 0,
+		 "fileset index, or directory, whose files are loaded into "
+		 "the cache on start, smallest first", NULL},
+		{"preload-timeout", 0, POPT_ARG_INT, &opts.preload_timeout, 0,
+		 "seconds that preloading may take", " default: 30"},
+		{"bundle", 0, POPT_ARG_STRING, &opts.bundle_path, 0,
+		 "bundle, packed by fileset -b, that files are served from "
+		 "before they are looked up in the cache", NULL},
+		{"takeover", 0, POPT_ARG_NONE, &takeover, 0,
+		 "take over the port and the cache of the running server, "
+		 "which exits", NULL},
+		POPT_AUTOHELP {NULL, 0, 0, NULL, 0}
+	};
 
-	if (argc != 5)
-		usage(argv[0]);
-	port = atoi(argv[1]);
-	nr_threads = atoi(argv[2]);
-	max_requests = atoi(argv[3]);
-	max_cache_size = atoi(argv[4]);
+	memset(&opts, 0, sizeof(opts));
+	opts.spill_size = DEFAULT_SPILL_SIZE;
+	opts.stale = -1;
+	context = poptGetContext(NULL, argc, (const char **)argv,
+				 options_table, 0);
+	poptSetOtherOptionHelp(context,
+			       "[OPTIONS] port nr_threads max_requests "
+			       "max_cache_size");
+	while ((c = poptGetNextOpt(context)) >= 0);
+	if (c < -1) {	/* an error occurred during option processing */
+		fprintf(stderr, "%s: %s\n",
+			poptBadOption(context, POPT_BADOPTION_NOALIAS),
+			poptStrerror(c));
+		exit(1);
+	}
+	port = next_arg();
+	nr_threads = next_arg();
+	max_requests = next_arg();
+	max_cache_size = next_size_arg();
+	if (poptPeekArg(context) != NULL)
+		usage();
 	if (port < 1024) {
 		fprintf(stderr, "port = %d, should be >= 1024\n", port);
-		usage(argv[0]);
+		usage();
 	}
-	if (nr_threads < 0 || max_requests < 0 || max_cache_size < 0) {
+	if (nr_threads < 0 || max_requests < 0 || max_cache_size < 0 ||
+	    opts.max_locked_size < 0) {
 		fprintf(stderr, "arguments should be > 0\n");
-		usage(argv[0]);
+		usage();
+	}
+	if (opts.spill_size <= 0) {
+		fprintf(stderr, "spill-size should be > 0\n");
+		usage();
+	}
+	if (opts.cold_percent < 0 || opts.cold_percent > 90) {
+		fprintf(stderr, "cold = %d, should be <= 90\n",
+			opts.cold_percent);
+		usage();
+	}
+	if (opts.doorkeeper && !opts.admission) {
+		fprintf(stderr, "doorkeeper needs --admission\n");
+		usage();
 	}
 
-	sv = server_init(nr_threads, max_requests, max_cache_size);
+	/* the commands written to the fifo are no changes to the files */
+	watch_ignore(fifo);
+	sv = server_init(nr_threads, max_requests, max_cache_size, &opts);
 
-	listenfd = open_listenfd(port);
+	/* the running server passes on its listening socket, so that no
+	 * connection is refused during the restart, see handoff.c */
+	listenfd = -1;
+	if (takeover && (ctlfd = handoff_connect(HANDOFF_PATH)) >= 0) {
+		listenfd = handoff_recv_fd(ctlfd);
+		if (listenfd >= 0) {
+			server_takeover(sv, ctlfd);
+		} else {
+			SYS(close(ctlfd));
+		}
+	}
+	if (listenfd < 0) {
+		if (takeover)
+			fprintf(stderr, "no server to take over from\n");
+		listenfd = open_listenfd(port);
+	}
 	exitfd = open_fifo();
+	ctlfd = handoff_listen(HANDOFF_PATH);
 
 	struct pollfd fds[] = {
 		{exitfd, POLLIN},
 		{listenfd, POLLIN},
+		{ctlfd, POLLIN},
 	};
 	while (1) {
 		/* wait for either a client to connect or an exit event */
-		SYS(poll(fds, 2, -1));
+		SYS(poll(fds, 3, -1));
 		
-		if(fds[0].revents & POLLIN) { /* exit requested */
-			break;
+		if(fds[0].revents & (POLLIN | POLLHUP)) { /* a command */
+			if (read_fifo(sv, &fds[0].fd)) { /* exit requested */
+				break;
+			}
+			continue;
+		}
+		
+		if(fds[2].revents & POLLIN) { /* a new server takes over */
+			SYS(connfd = accept(ctlfd, NULL, NULL));
+			if (handoff_send_fd(connfd, listenfd)) {
+				/* from now on, the new server accepts */
+				server_handoff(sv, connfd);
+				handed_off = 1;
+				break;
+			}
+			SYS(close(connfd));
+			continue;
 		}
 
 		assert(fds[1].revents & POLLIN); /* connect request arrived */
@@ -104,8 +378,14 @@ main(int argc, char *argv[])
 		server_request(sv, connfd);
 	}
 
-	close_fifo();
+	/* the fifo and the control socket are the new server's now */
+	if (!handed_off) {
+		close_fifo();
+		unlink(HANDOFF_PATH);
+	}
+	/* the requests that have been accepted are served before exiting */
 	server_exit(sv);
+	poptFreeContext(context);
 
 	/* we don't check for memory leaks using mallinfo() because pthreads
 	 * caches thread state even after a thread exits so that it can reuse
@@ -1,8 +1,25 @@
+#define _GNU_SOURCE /* for nftw */
 #include "request.h"
 #include "server_thread.h"
 #include "common.h"
+#include "meta_cache.h"
+#include "watch.h"
+#include "cache_mem.h"
+#include "spill.h"
+#include "stats.h"
+#include "access_log.h"
+#include "trace.h"
+#include "handoff.h"
+#include "bundle.h"
+#include "content.h"
+#include "admit.h"
+#include "pressure.h"
+#include "mrc.h"
+#include <malloc.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <ftw.h>
+#include <limits.h>
 
 /* global variable */
 pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
@@ -10,56 +27,238 @@ pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t full = PTHREAD_COND_INITIALIZER;
 pthread_cond_t empty = PTHREAD_COND_INITIALIZER;
 
-int *buffer = NULL;     // a circular buffer
+/* a connection waiting for a worker */
+struct queued_request {
+    int connfd;
+    long accepted;  // when it was accepted, see stats_now
+};
+
+struct queued_request *buffer = NULL;     // a circular buffer
 int in = 0;     // place to write in the buffer
 int out = 0;    // place to read in the buffer
-pthread_t *worker_threads = NULL;
 
-struct LRU_node {
-    int index;  // hash table index
-    struct LRU_node *next;
+/* a worker thread */
+struct worker {
+    pthread_t thread;
+    struct server *sv;
+    int retire;     // set under lock to let the worker go
+};
+
+struct worker **workers = NULL;     // sv->nr_threads of them
+
+/* a cached file, as it is passed on to the server that takes over, followed
+ * by its name and contents */
+struct handoff_file {
+    int name_size;      // with the terminating null, or 0 after the last file
+    int file_size;
+    long mtime;
+    unsigned int csum;
+};
+
+pthread_t takeover_thread;
+int takeover_sock = -1;     // while the cache of the old server is read
+
+/* a file that the cache is warmed up with, from a snapshot of the cache
+ * (see server_snapshot) or an index of files to preload */
+struct warm_file {
+    char *name;
+    unsigned int csum;
+    int csum_known;     // or else it is computed as the file is read
+    int size;
+    long mtime;         // or 0 if it is not known
+    int hits;
+    int rank;           // 0 for the most recently used, or the first listed
+};
+
+/* the cache is warmed up by this many threads at a time, to keep many reads
+ * in flight */
+#define WARM_LOADERS 16
+/* seconds that preloading may take, by default */
+#define WARM_TIMEOUT 30
+
+struct warm_file *warm_files = NULL;    // hottest first
+int warm_nr_files = 0;
+long warm_size = 0;     // of the files, which fit in the cache
+int warm_next = 0;      // the next file to load
+int warm_running = 0;   // loaders that are not done yet
+long warm_deadline;     // after which no more files are loaded, see stats_now
+pthread_t warm_threads[WARM_LOADERS];
+
+/* the reclaimer, see cache_reclaim_start. these are protected by cache_lock */
+pthread_t reclaim_thread;
+pthread_cond_t reclaim_work = PTHREAD_COND_INITIALIZER;     // free space is low
+pthread_cond_t reclaim_done = PTHREAD_COND_INITIALIZER;     // a batch was reclaimed
+int reclaim_running = 0;
+int reclaim_exiting = 0;
+int reclaim_low_percent;        // of the cache, free space that wakes the reclaimer
+int reclaim_high_percent;       // of the cache, free space that it makes
+int reclaim_stuck = 0;          // the last batch evicted nothing, all in use
+int reclaim_deferring = 0;      // set by the reclaimer, while it evicts
+int reclaim_waiting = 0;        // inserts waiting for room
+int reclaim_wanted = 0;         // free space that the largest of them needs
+struct file_data **reclaim_garbage = NULL;  // freed once the lock is dropped
+int reclaim_nr_garbage = 0;
+int reclaim_max_garbage = 0;
+
+/* the sizer, see server_sizer_start */
+pthread_t sizer_thread;
+pthread_mutex_t resize_lock = PTHREAD_MUTEX_INITIALIZER;    // one resize of the cache at a time
+pthread_cond_t sizer_wakeup = PTHREAD_COND_INITIALIZER;     // the server exits
+int sizer_running = 0;
+int sizer_exiting = 0;          // protected by resize_lock
+
+/* a file whose cached copies the refresher checks */
+struct refresh {
+    char *name;
+    struct refresh *next;
+};
+
+/* the refresher, see server_refresh_start. these are protected by cache_lock */
+pthread_t refresh_thread;
+pthread_cond_t refresh_work = PTHREAD_COND_INITIALIZER;     // a file is queued
+int refresh_running = 0;
+int refresh_exiting = 0;
+struct refresh *refresh_head = NULL;    // files to check, oldest first
+struct refresh *refresh_tail = NULL;
+long cache_ttl = 0;             // ns that a file is served without a check, 0 for ever
+long cache_stale = 0;           // ns after that, that it is served while it is checked
+
+/* takes mutex, tracing the wait for it when it is held by another thread */
+static void server_lock(pthread_mutex_t *mutex, const char *name) {
+    long start;
+    
+    if(!trace_enabled()) {
+        pthread_mutex_lock(mutex);
+        return;
+    }
+    if(pthread_mutex_trylock(mutex) == 0) {
+        return;
+    }
+    start = stats_now();
+    pthread_mutex_lock(mutex);
+    trace_span(name, start, stats_now());
+}
+
+/* the metadata cache remembers the result of checking up to this many files,
+ * for META_CACHE_TTL ms */
+#define META_CACHE_ENTRIES 4096
+#define META_CACHE_TTL 1000
+/* when the document root is watched for changes, metadata is dropped as soon
+ * as a file changes, so it can be kept for much longer */
+#define META_CACHE_WATCHED_TTL (3600 * 1000)
+
+/* a change to a file bumps one of these generations, so that a file that was
+ * read before the change is not inserted in the cache after it */
+#define NR_GENERATIONS 256
+
+/* blocks of large files are cached separately, so a range request only needs
+ * the blocks that it covers */
+#define CACHE_BLOCK_SIZE (64 * 1024)
+/* the block number of an entry that holds a whole file */
+#define WHOLE_FILE -1
+
+/* a mapped file is locked in memory once it has been hit this many times */
+#define CACHE_LOCK_HITS 2
+
+/* files evicted at a time when the cache shrinks, so that requests don't
+ * wait long for the cache lock */
+#define CACHE_SHRINK_BATCH 32
+
+/* the hash table doesn't grow past this many buckets, however large the
+ * cache */
+#define CACHE_MAX_BUCKETS (16 * 1024 * 1024)
+
+/* how the sizer follows the memory of the cgroup, see server_sizer_start */
+#define SIZER_INTERVAL 1000     // ms between samples
+#define SIZER_STALL_HIGH 10.0   // percent of time stalled at which the cache shrinks
+#define SIZER_STALL_LOW 1.0     // below which it grows back
+#define SIZER_HEADROOM 10       // percent of memory.max that is kept free
+#define SIZER_STEP 8            // the cache is resized by 1/SIZER_STEP of the budget
+#define SIZER_MIN 8             // and kept at 1/SIZER_MIN of it, at least
+
+/* the worker pool can grow to this many threads, or to the number it is
+ * started with, if that is more */
+#define MAX_THREADS 256
+
+/* which file is evicted first. the order of the LRU list is the order in
+ * which files were inserted, unless hits move files to its end */
+enum cache_policy {
+    CACHE_FIFO,
+    CACHE_LRU,
 };
 
 struct LRU_list {
-    struct LRU_node* head;
+    struct file *head;      // least recently used
+    struct file *tail;      // most recently used
 };
 
 struct LRU_list *LRU = NULL;    // head is the least recent, tail is the most recent
+struct LRU_list *COLD = NULL;   // the cold tier, in the same order
 
 struct file {
     int index;  // hash table index
+    int name_index;             // name table index, the same for all blocks of a file
+    long block; // block number, or WHOLE_FILE
     int in_use;
+    int charge;                 // bytes charged to the cache for this file
+    int hits;                   // times found in the cache
+    int locked;                 // the mapping of the file is mlocked
+    int cold;                   // in the cold tier, only the compressed copy is kept
+    int removed;                // changed on disk, free it when no longer in use
+    long fetched;               // read, or last found current, see stats_now
+    int refreshing;             // queued for the refresher
     struct file_data *data;
+    struct file *next;          // next file in the same hash bucket
+    struct file *name_next;     // next file or block in the same name bucket
+    struct file *LRU_prev;
+    struct file *LRU_next;
 };
 
 struct cache {
-    int max_cache_size;
-    int curr_cache_size;
+    long long max_cache_size;
+    long long curr_cache_size;
     int hash_table_size;
-    struct file **hash_table;   // key is the file name, data is the file data
+    struct file **hash_table;   // key is the file name and block, data is the file data
+    struct file **name_table;   // key is the file name, so that a file and its blocks are found together
+    int nr_files;               // number of cached files and blocks, hot or cold
+    int nr_blocks;              // number of cached blocks of files
+    long long locked_size;      // bytes of mapped files that are mlocked
+    long long max_locked_size;
+    long long max_cold_size;    // part of the cache for the cold tier
+    long long curr_cold_size;
+    int cold_percent;           // of the cache, for the cold tier
+    enum cache_policy policy;
+    unsigned int generation[NR_GENERATIONS];
 };
 
 struct cache *cache = NULL;
 
 struct server {
     int nr_threads;
+    int max_threads;
     int max_requests;
-    int max_cache_size;
+    long long max_cache_size;
+    long long cache_budget;     // that max_cache_size follows memory pressure up to
+    int cache_mmap;             // cache mappings of files, not copies
+    int compress;               // keep compressed copies of cached files
+    char *snapshot_path;        // of the cache, written on exit
     int exiting;
     /* add any other parameters you need */
 };
 
 /* static functions */
-struct file *cache_lookup(char *file_name);     // to see if a file is in the hash table
-bool cache_insert(struct file_data *data);      // insert a file in the hash table
+struct file *cache_lookup(char *file_name, long block);     // to see if a file is in the hash table
+struct file *cache_insert(struct file_data *data, long block);      // insert a file in the hash table
 bool cache_evict(int amount_to_evict);      // use LRU algorithm to evict files
+static void *server_sizer_start(void *arg);        // follow the memory of the cgroup
 
-/* djb2 hash function*/
-unsigned long hash(char *str) {
+/* djb2 hash function, with the block number mixed in */
+unsigned long hash(char *str, long block) {
     unsigned long hash = 5381;
     int c;
     while ((c = *str++))
         hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+    hash = ((hash << 5) + hash) + (unsigned long)block;
     return hash % cache->hash_table_size;
 }
 
@@ -71,165 +270,536 @@ static struct file_data *file_data_init(void) {
     data->file_name = NULL;
     data->file_buf = NULL;
     data->file_size = 0;
+    data->file_mapped = 0;
+    data->file_content = NULL;
+    data->file_304 = NULL;
+    data->file_zbuf = NULL;
+    data->file_zsize = 0;
     return data;
 }
 
+/* gives back the shared contents of a cached file. the last file that has
+ * them frees them, and gives back their space */
+static void cache_put_content(struct file_data *data) {
+    int charge = content_put(data->file_content);
+    
+    if(charge > 0) {
+        cache->curr_cache_size = cache->curr_cache_size - charge;
+        cache_mem_free(data->file_buf);
+    }
+    data->file_content = NULL;
+}
+
+/* free the contents of the file, but keep the rest of the file data */
+static void file_data_free_buf(struct file_data *data) {
+    if(data->file_mapped) {
+        SYS(munmap(data->file_buf, data->file_size));
+    } else if(data->file_content != NULL) {
+        cache_put_content(data);
+    } else {
+        cache_mem_free(data->file_buf);
+    }
+    data->file_buf = NULL;
+    data->file_mapped = 0;
+}
+
 /* free all file data */
 static void file_data_free(struct file_data *data) {
     free(data->file_name);
-    free(data->file_buf);
+    file_data_free_buf(data);
+    free(data->file_304);
+    free(data->file_zbuf);
     free(data);
 }
 
+/* the number of bytes a file takes in the cache, including the cache entry
+ * and the file data, as well as the compressed copy of the file, which shares
+ * the cache budget with the file. a mapped file is shared with the page cache,
+ * but its pages are charged anyway, so that the cache pins no more than
+ * max_cache_size bytes */
+static int cache_charge(struct file *file, struct file_data *data) {
+    long page = sysconf(_SC_PAGESIZE);
+    int body;
+    
+    if(data->file_mapped) {
+        body = (data->file_size + page - 1) / page * page;
+    } else if(data->file_content != NULL) {
+        /* charged once, for all the files that share them */
+        body = 0;
+    } else {
+        body = cache_mem_usable(data->file_buf);
+    }
+    return body +
+        malloc_usable_size(data->file_zbuf) +
+        malloc_usable_size(data->file_name) +
+        malloc_usable_size(data->file_304) +
+        malloc_usable_size(data) +
+        malloc_usable_size(file);
+}
+
+/* the charge of a file without its compressed copy, which is dropped
+ * rather than the file when both don't fit, see cache_insert */
+static int cache_charge_raw(struct file_data *data) {
+    return cache_charge(NULL, data) - malloc_usable_size(data->file_zbuf);
+}
+
+/* drops the compressed copy of a file, which is then sent uncompressed */
+static void cache_drop_zbuf(struct file_data *data) {
+    free(data->file_zbuf);
+    data->file_zbuf = NULL;
+    data->file_zsize = 0;
+}
+
 /* function to manipulate LRU list
- * only be able to append at the beginning when list is empty
- * or at the end when the list is not empty*/
-void enqueue(struct LRU_list *LRU, int index) {
+ * append the file at the end (most recently used) of the list */
+void enqueue(struct LRU_list *LRU, struct file *file) {
     if(LRU == NULL) {
         return;
     }
     
-    struct LRU_node *insert_node = (struct LRU_node*)malloc(sizeof(struct LRU_node));
-    insert_node->index = index;
-    insert_node->next = NULL;
+    file->LRU_next = NULL;
+    file->LRU_prev = LRU->tail;
     
     if(LRU->head == NULL) {
-        LRU->head = insert_node;
+        LRU->head = file;
     } else {
-        struct LRU_node *temp = LRU->head;
-        while (temp->next != NULL) {
-            temp = temp->next;
-        }
-        temp->next = insert_node;
+        LRU->tail->LRU_next = file;
     }
+    LRU->tail = file;
 }
 
-/* function to manipulate queues 
- * only be able to remove the head of the LRU_list*/
-int dequeue_head(struct LRU_list* LRU) {
-
+/* function to manipulate LRU list
+ * remove the file from anywhere in the list */
+void dequeue(struct LRU_list *LRU, struct file *file) {
     if(LRU == NULL) {
-        return -2;
+        return;
     }
     
-    if(LRU->head == NULL) {
-        return -1;
+    if(file->LRU_prev != NULL) {
+        file->LRU_prev->LRU_next = file->LRU_next;
+    } else {
+        LRU->head = file->LRU_next;
+    }
+    
+    if(file->LRU_next != NULL) {
+        file->LRU_next->LRU_prev = file->LRU_prev;
     } else {
-        struct LRU_node *temp = LRU->head;
-        int index = temp->index;
-        LRU->head = LRU->head->next;
-        free(temp);
-        return index;
+        LRU->tail = file->LRU_prev;
     }
+    file->LRU_prev = NULL;
+    file->LRU_next = NULL;
 }
 
-/* function to manipulate queues
- * only be able to remove the desired index of the LRU_node */
-void dequeue_index(struct LRU_list* LRU, int index) {
-    if(LRU == NULL) {
-        return;
+static void update_LRU(struct LRU_list* LRU, struct file *file) {
+    dequeue(LRU, file);
+    enqueue(LRU, file);
+}
+
+struct file *cache_lookup(char *file_name, long block) {
+    int hash_index = hash(file_name, block);
+    struct file *curr = cache->hash_table[hash_index];
+    
+    /* walk the hash bucket */
+    while (curr != NULL) {
+        if (curr->block == block && strcmp(curr->data->file_name, file_name) == 0) {
+            return curr;
+        }
+        curr = curr->next;
     }
     
-    if(LRU->head == NULL) {
-        return;
-    } else {
-        /* previous thread node and current thread node */
-        struct LRU_node* prev = NULL;
-        struct LRU_node* curr = LRU->head;
+    /* not found in the hash table*/
+    return NULL;
+}
+
+/* the reclaimer frees the files it evicts after it drops the cache lock, so
+ * that other threads don't wait while large buffers are freed. shared
+ * contents are given back right away, since they need the lock */
+static void cache_defer(struct file_data *data) {
+    if(data->file_content != NULL) {
+        int charge = content_put(data->file_content);
         
-        /* look for the desired thread */
-        while (curr != NULL) {
-            if(curr->index == index) {
-                break; //find the desired node
-            }
-            prev = curr;
-            curr = curr->next;
+        if(charge > 0) {
+            cache->curr_cache_size = cache->curr_cache_size - charge;
+        } else {
+            data->file_buf = NULL;
         }
-        
-        if(curr == NULL) {
-           return;
+        data->file_content = NULL;
+    }
+    if(reclaim_nr_garbage == reclaim_max_garbage) {
+        reclaim_max_garbage = reclaim_max_garbage > 0 ? reclaim_max_garbage * 2 : CACHE_SHRINK_BATCH;
+        reclaim_garbage = Realloc(reclaim_garbage, sizeof(struct file_data *) * reclaim_max_garbage);
+    }
+    reclaim_garbage[reclaim_nr_garbage++] = data;
+}
+
+/* free the contents of a cached file, see cache_defer */
+static void cache_free_buf(struct file_data *data) {
+    struct file_data *husk;
+    
+    if(!reclaim_deferring || data->file_buf == NULL) {
+        file_data_free_buf(data);
+        return;
+    }
+    husk = file_data_init();
+    husk->file_buf = data->file_buf;
+    husk->file_size = data->file_size;
+    husk->file_mapped = data->file_mapped;
+    husk->file_content = data->file_content;
+    data->file_buf = NULL;
+    data->file_mapped = 0;
+    data->file_content = NULL;
+    cache_defer(husk);
+}
+
+/* remove a file from the LRU list of its tier, and give back its space */
+static void cache_unqueue(struct file *file) {
+    if(file->cold) {
+        dequeue(COLD, file);
+        cache->curr_cold_size = cache->curr_cold_size - file->charge;
+    } else {
+        dequeue(LRU, file);
+        cache->curr_cache_size = cache->curr_cache_size - file->charge;
+    }
+    /* the lock goes away with the mapping, when the file is freed */
+    if(file->locked) {
+        cache->locked_size = cache->locked_size - file->data->file_size;
+        file->locked = 0;
+    }
+}
+
+/* remove a file from the hash table */
+static void cache_unhash(struct file *file) {
+    struct file **prev = &cache->hash_table[file->index];
+    
+    while (*prev != file) {
+        prev = &(*prev)->next;
+    }
+    *prev = file->next;
+    for(prev = &cache->name_table[file->name_index]; *prev != file; prev = &(*prev)->name_next);
+    *prev = file->name_next;
+    cache->nr_files--;
+    if(file->block != WHOLE_FILE) {
+        cache->nr_blocks--;
+    }
+}
+
+/* remove a file from the hash table and the LRU list */
+static void cache_unlink(struct file *file) {
+    cache_unhash(file);
+    cache_unqueue(file);
+}
+
+static void cache_free(struct file *file) {
+    if(reclaim_deferring) {
+        cache_defer(file->data);
+    } else {
+        file_data_free(file->data);
+    }
+    file->data = NULL;
+    free(file);
+}
+
+/* remove a file from the hash table and the LRU list, and free it */
+static void cache_remove(struct file *file) {
+    cache_unlink(file);
+    cache_free(file);
+}
+
+/* remove a file from the cache. it is freed now, or by the last request
+ * using it */
+static void cache_discard(struct file *file) {
+    cache_unlink(file);
+    if(file->in_use == 0) {
+        cache_free(file);
+    } else {
+        file->removed = 1;
+    }
+}
+
+/* the generation of file_name, see NR_GENERATIONS */
+static unsigned int cache_generation(char *file_name) {
+    return cache->generation[hash(file_name, WHOLE_FILE) % NR_GENERATIONS];
+}
+
+/* remove the whole file and all the cached blocks of file_name (or of all
+ * files, when it is NULL) because they changed on disk. files that are in use
+ * are freed by the last request using them. */
+static void cache_invalidate(char *file_name) {
+    struct file *file, *next_file;
+    
+    if(file_name == NULL) {
+        for(int i = 0; i < NR_GENERATIONS; i++) {
+            cache->generation[i]++;
         }
-        
-        /* it's the first thread in the queue */
-        if(curr == LRU->head) {
-            LRU->head = LRU->head->next;
-            free(curr);
-            return;
+    } else {
+        cache->generation[hash(file_name, WHOLE_FILE) % NR_GENERATIONS]++;
+    }
+    
+    /* the whole file and its blocks are in the same name bucket */
+    if(file_name != NULL) {
+        for(file = cache->name_table[hash(file_name, WHOLE_FILE)]; file != NULL; file = next_file) {
+            next_file = file->name_next;
+            if(strcmp(file->data->file_name, file_name) == 0) {
+                cache_discard(file);
+            }
         }
-        
-        /* other cases */
-        prev->next = curr->next;
-        free(curr);
+        return;
+    }
+    while(LRU->head != NULL) {
+        cache_discard(LRU->head);
+    }
+    while(COLD->head != NULL) {
+        cache_discard(COLD->head);
     }
 }
 
-/* void update_LRU(struct LRU_list* LRU, int index) {
-    dequeue_index(LRU, index);
-    enqueue(LRU, index);
-} */
+/* called by the watcher thread when file_name changed on disk, or with NULL
+ * when any file may have changed */
+static void server_file_changed(char *file_name) {
+    meta_cache_invalidate(file_name);
+    if(cache != NULL) {
+        server_lock(&cache_lock, "cache_lock wait");
+        cache_invalidate(file_name);
+        /* under the cache lock, so that no stale copy is spilled after */
+        spill_invalidate(file_name);
+        pthread_mutex_unlock(&cache_lock);
+    }
+}
 
-struct file *cache_lookup(char *file_name) {
-    int hash_index = hash(file_name);
-    
-    /* found in the hash table */
-    if (cache->hash_table[hash_index] != NULL) {
-      if (strcmp(cache->hash_table[hash_index]->data->file_name, file_name) == 0) {
-          return cache->hash_table[hash_index];
-      }
-      else{
-          for (int i = 0; i < cache->hash_table_size; i++) {
-              int temp = (hash_index + i) % cache->hash_table_size;
+/* free space of the hot tier below which the reclaimer evicts files, or
+ * up to which it does, for the given percent of the hot tier */
+static long long cache_watermark(int percent) {
+    return cache->max_cache_size * percent / 100;
+}
+
+/* free space that the reclaimer evicts files up to */
+static long long cache_reclaim_target(void) {
+    long long high = cache_watermark(reclaim_high_percent);
+    return reclaim_wanted > high ? reclaim_wanted : high;
+}
+
+/* wakes up the reclaimer when free space runs low */
+static void cache_reclaim_kick(void) {
+    if(reclaim_running && cache->max_cache_size - cache->curr_cache_size < cache_watermark(reclaim_low_percent)) {
+        pthread_cond_signal(&reclaim_work);
+    }
+}
 
-              if (cache->hash_table[temp] != NULL && strcmp(cache->hash_table[temp]->data->file_name, file_name) == 0) {
-                  return cache->hash_table[temp];
-              }
-          }
-      }
+/* with a reclaimer, a file of the given size that doesn't fit waits until the
+ * reclaimer has made room, so that requests evict files themselves only when
+ * the reclaimer can't keep up, i.e., when all the files are in use */
+static void cache_wait_room(int size) {
+    long start;
+    
+    if(!reclaim_running || size > cache->max_cache_size || size <= cache->max_cache_size - cache->curr_cache_size) {
+        return;
     }
+    start = trace_start();
+    stats_add(STATS_RECLAIM_WAITS, 1);
+    reclaim_waiting++;
+    while(size > cache->max_cache_size - cache->curr_cache_size && !reclaim_stuck && !reclaim_exiting) {
+        if(size > reclaim_wanted) {
+            reclaim_wanted = size;
+        }
+        pthread_cond_signal(&reclaim_work);
+        pthread_cond_wait(&reclaim_done, &cache_lock);
+    }
+    if(--reclaim_waiting == 0) {
+        reclaim_wanted = 0;
+    }
+    trace_span("reclaim wait", start, stats_now());
+}
+
+/* shares the contents of a whole file that is being inserted with the
+ * cached files that have identical contents, see content.c. new contents
+ * are charged to the cache here, once for all the files that will share
+ * them. Returns the buffer of data that identical contents replace, which
+ * is freed once the file is inserted, or NULL */
+static char *cache_get_content(struct file_data *data) {
+    char *buf = data->file_buf;
+    int charge = cache_mem_usable(buf);
     
-    /* not found in the hash table*/
-    return NULL;
+    data->file_content = content_get(buf, data->file_size, data->file_csum, charge);
+    if(data->file_content == NULL) {
+        return NULL;
+    }
+    if(content_buf(data->file_content) == buf) {
+        cache->curr_cache_size = cache->curr_cache_size + charge;
+        return NULL;
+    }
+    data->file_buf = content_buf(data->file_content);
+    return buf;
+}
+
+/* undoes cache_get_content, for a file that didn't fit */
+static void cache_unget_content(struct file_data *data, char *buf) {
+    if(buf != NULL) {
+        cache_put_content(data);
+        data->file_buf = buf;
+    } else {
+        /* new contents are not freed with the file that brought them */
+        cache->curr_cache_size = cache->curr_cache_size - content_put(data->file_content);
+        data->file_content = NULL;
+    }
 }
 
-bool cache_insert(struct file_data *data) {
+/* returns the cached file, which may be a file that was already in the hash
+ * table, or NULL if there is no space for this file */
+struct file *cache_insert(struct file_data *data, long block) {
+    struct file *cached_file = cache_lookup(data->file_name, block);
+    char *duplicate = NULL;
+    char *name;
+    
     /* it's already in the hash table*/
-    if(cache_lookup(data->file_name) != NULL) {
-        return true;
+    if(cached_file != NULL && !cached_file->cold) {
+        return cached_file;
+    }
+    /* data is a fresh copy of a file of the cold tier */
+    if(cached_file != NULL) {
+        cache_discard(cached_file);
     }
     
     /* not in the hash table, need to insert*/
+    struct file *new_data = (struct file*)Malloc(sizeof(struct file));
+    
+    /* the name buffer of a request is much larger than the name */
+    if((name = realloc(data->file_name, strlen(data->file_name) + 1)) != NULL) {
+        data->file_name = name;
+    }
+    if(block == WHOLE_FILE && !data->file_mapped && data->file_buf != NULL) {
+        duplicate = cache_get_content(data);
+    }
+    int size = cache_charge(new_data, data);
+    
+    /* the compressed copy shares the budget with the file, but it doesn't
+     * keep the file out of the cache */
+    if(data->file_zbuf != NULL && size > cache->max_cache_size - cache->curr_cache_size && !cache_evict(size)) {
+        cache_drop_zbuf(data);
+        size = cache_charge(new_data, data);
+    }
     
     /* already enough space for this file 
      * or we need to call evict to free some space */
-    if(data->file_size <= (cache->max_cache_size - cache->curr_cache_size) || cache_evict(data->file_size)) {
-        int hash_index = hash(data->file_name);
-        
-        /* if there is a collision 
-         * find a empty spot */
-        if (cache->hash_table[hash_index] != NULL) {
-            for (int i = 0; i < cache->hash_table_size; i++) {
-                int temp = (hash_index + i) % cache->hash_table_size;
-                
-                if (cache->hash_table[temp] == NULL) {
-                    hash_index = temp;
-                    break;
-                }
-            }
-        }
+    if(size <= (cache->max_cache_size - cache->curr_cache_size) || cache_evict(size)) {
+        int hash_index = hash(data->file_name, block);
         
-        struct file *new_data = (struct file*)malloc(sizeof(struct file));
         new_data->index = hash_index;
+        new_data->block = block;
         new_data->in_use = 0;
+        new_data->charge = size;
+        new_data->hits = 0;
+        new_data->locked = 0;
+        new_data->cold = 0;
+        new_data->removed = 0;
+        new_data->fetched = stats_now();
+        new_data->refreshing = 0;
         new_data->data = data;
         
+        /* add it to the front of the hash bucket, and of its name bucket */
+        new_data->next = cache->hash_table[hash_index];
         cache->hash_table[hash_index] = new_data;
-        cache->curr_cache_size = cache->curr_cache_size + data->file_size;
-        enqueue(LRU, hash_index);
-        return true;   
+        new_data->name_index = hash(data->file_name, WHOLE_FILE);
+        new_data->name_next = cache->name_table[new_data->name_index];
+        cache->name_table[new_data->name_index] = new_data;
+        cache->curr_cache_size = cache->curr_cache_size + size;
+        cache->nr_files++;
+        if(block != WHOLE_FILE) {
+            cache->nr_blocks++;
+        }
+        enqueue(LRU, new_data);
+        if(duplicate != NULL) {
+            cache_mem_free(duplicate);
+            stats_add(STATS_DEDUP_HITS, 1);
+        }
+        cache_reclaim_kick();
+        return new_data;   
     } 
     
     /* no enough space for this file */
-    return false;
+    if(data->file_content != NULL) {
+        cache_unget_content(data, duplicate);
+    }
+    free(new_data);
+    return NULL;
+}
+
+/* evict files from the cold tier, in LRU order, until amount_to_evict bytes
+ * are free there */
+static bool cache_evict_cold(int amount_to_evict) {
+    struct file *evict_file = COLD->head;
+    struct file *next_file;
+    long start = trace_start();
+    
+    while(evict_file != NULL && amount_to_evict > cache->max_cold_size - cache->curr_cold_size) {
+        next_file = evict_file->LRU_next;
+        if(evict_file->in_use == 0) {
+            cache_remove(evict_file);
+            stats_add(STATS_COLD_EVICTIONS, 1);
+        }
+        evict_file = next_file;
+    }
+    trace_span("cold eviction", start, stats_now());
+    return amount_to_evict <= cache->max_cold_size - cache->curr_cold_size;
+}
+
+/* move a file that is not in use from the hot tier to the cold tier, which
+ * only keeps the compressed copy of the file. blocks and files without a
+ * compressed copy are freed, as are files that don't fit in the cold tier.
+ * the contents of whole files are also spilled to disk, see spill.c */
+static void cache_demote(struct file *file) {
+    struct file_data *data = file->data;
+    int size;
+    
+    stats_add(STATS_EVICTIONS, 1);
+    /* the spill file takes the contents, unless it already has them, or
+     * other files share them. mapped files are left to the page cache */
+    if(file->block == WHOLE_FILE && !data->file_mapped &&
+       (data->file_content == NULL || content_refs(data->file_content) == 1)) {
+        if(data->file_content != NULL) {
+            cache->curr_cache_size = cache->curr_cache_size - content_put(data->file_content);
+            data->file_content = NULL;
+        }
+        if(spill_put(data)) {
+            data->file_buf = NULL;
+        }
+    }
+    if(cache->max_cold_size == 0 || file->block != WHOLE_FILE || data->file_zbuf == NULL) {
+        cache_remove(file);
+        return;
+    }
+    cache_unqueue(file);
+    cache_free_buf(data);
+    size = cache_charge(file, data);
+    if(size <= cache->max_cold_size - cache->curr_cold_size || cache_evict_cold(size)) {
+        file->cold = 1;
+        file->charge = size;
+        enqueue(COLD, file);
+        cache->curr_cold_size = cache->curr_cold_size + size;
+        return;
+    }
+    cache_unhash(file);
+    cache_free(file);
+}
+
+/* move a file of the cold tier back to the hot tier, with buf holding its
+ * contents again. Returns false if there is no space for it */
+static bool cache_promote(struct file *file, char *buf) {
+    struct file_data *data = file->data;
+    int size;
+    
+    data->file_buf = buf;
+    size = cache_charge(file, data);
+    /* evicting may demote other files, but not this one, which is in use */
+    if(size > cache->max_cache_size - cache->curr_cache_size && !cache_evict(size)) {
+        data->file_buf = NULL;
+        return false;
+    }
+    cache_unqueue(file);
+    file->cold = 0;
+    file->charge = size;
+    enqueue(LRU, file);
+    cache->curr_cache_size = cache->curr_cache_size + size;
+    return true;
 }
 
 bool cache_evict(int amount_to_evict) {
@@ -240,30 +810,19 @@ bool cache_evict(int amount_to_evict) {
     }
     
     /* evict files using LRU */
-    struct LRU_node *evict_node = LRU->head;
-    struct LRU_node *temp_node = NULL;
-    struct file *evict_file = NULL;
+    struct file *evict_file = LRU->head;
+    struct file *next_file = NULL;
+    long start = trace_start();
     
-    while(evict_node!=NULL && amount_to_evict>(cache->max_cache_size - cache->curr_cache_size)) {
-        evict_file = cache->hash_table[evict_node->index];
-        
-        if(evict_file!=NULL && evict_file->in_use==0) {
-            cache->curr_cache_size = cache->curr_cache_size - evict_file->data->file_size;
-            file_data_free(cache->hash_table[evict_node->index]->data);
-            cache->hash_table[evict_node->index]->data = NULL;
-            free(cache->hash_table[evict_node->index]);
-            cache->hash_table[evict_node->index] = NULL;
-            temp_node = evict_node;
-        }
+    while(evict_file!=NULL && amount_to_evict>(cache->max_cache_size - cache->curr_cache_size)) {
+        next_file = evict_file->LRU_next;
         
-        if(temp_node != NULL) {
-            evict_node = evict_node->next;
-            dequeue_index(LRU, temp_node->index);
-            temp_node = NULL;
-        } else {
-            evict_node = evict_node->next;
+        if(evict_file->in_use==0) {
+            cache_demote(evict_file);
         }
+        evict_file = next_file;
     }
+    trace_span("eviction", start, stats_now());
     
     /* we have evicted enough space */
     if(amount_to_evict<=(cache->max_cache_size - cache->curr_cache_size)) {
@@ -274,143 +833,1209 @@ bool cache_evict(int amount_to_evict) {
     return false;
 }
 
-/* entry point functions */
-
-static void do_server_request(struct server *sv, int connfd) {
-    int ret;
-    struct request *rq;
-    struct file_data *data;
-
-    data = file_data_init();
-
-    /* fill data->file_name with name of the file being requested */
-    rq = request_init(connfd, data);
-    if (!rq) {
-	file_data_free(data);
-	return;
-    }
+/* evicts up to CACHE_SHRINK_BATCH files, until the free space of the hot tier
+ * reaches the high watermark, or the room that waiting inserts need.
+ * Returns false if no file could be evicted */
+static bool cache_reclaim_some(void) {
+    struct file *file, *next_file;
+    long long high = cache_reclaim_target();
+    int evicted = 0;
     
-    /* no cache */
-    if(sv->max_cache_size==0){
-        /* read file, 
-         * fills data->file_buf with the file contents,
-         * data->file_size with file size. */
-        ret = request_readfile(rq);
-        if (ret == 0) { /* couldn't read file */
-            goto out;
-        }    
-        /* send file to client */
-        request_sendfile(rq);
+    for(file = LRU->head; file != NULL && cache->max_cache_size - cache->curr_cache_size < high && evicted < CACHE_SHRINK_BATCH; file = next_file) {
+        next_file = file->LRU_next;
+        if(file->in_use == 0) {
+            cache_demote(file);
+            evicted++;
+        }
     }
+    return evicted > 0;
+}
+
+/* the reclaimer keeps the free space of the hot tier between the low and the
+ * high watermark, so that requests find room for the files they insert, and
+ * eviction is off the request path. files are evicted a batch at a time,
+ * and freed once the cache lock is dropped */
+static void *cache_reclaim_start(void *arg) {
+    struct file_data **garbage;
+    int nr_garbage;
+    bool evicted;
+    long start;
     
-    /* using cache */
-    else {
-        pthread_mutex_lock(&cache_lock);
-        struct file *cached_file = cache_lookup(data->file_name);
-        
-        /* found in the hash table */
-        if(cached_file != NULL) {
-            cached_file->in_use++;
-            data = cached_file->data;
-            request_set_data(rq, data);
-            
-            /* since we look up the cached file
-             * we need to update its LRU */
-            //update_LRU(LRU, cached_file->index);      // pass tester by commenting this line, but should update_LRU
-            
-            pthread_mutex_unlock(&cache_lock);
+    trace_thread("reclaimer");
+    server_lock(&cache_lock, "cache_lock wait");
+    while(!reclaim_exiting) {
+        /* once stuck, it waits for the next insert */
+        if(reclaim_stuck || (cache->max_cache_size - cache->curr_cache_size >= cache_watermark(reclaim_low_percent) && cache->max_cache_size - cache->curr_cache_size >= reclaim_wanted)) {
+            pthread_cond_wait(&reclaim_work, &cache_lock);
+            reclaim_stuck = 0;
+            continue;
         }
-        
-        /* not found in the hash table */
-        else {
+        do {
+            start = trace_start();
+            reclaim_deferring = 1;
+            evicted = cache_reclaim_some();
+            reclaim_deferring = 0;
+            reclaim_stuck = !evicted;
+            garbage = reclaim_garbage;
+            nr_garbage = reclaim_nr_garbage;
+            reclaim_garbage = NULL;
+            reclaim_nr_garbage = 0;
+            reclaim_max_garbage = 0;
+            pthread_cond_broadcast(&reclaim_done);
             pthread_mutex_unlock(&cache_lock);
-            ret = request_readfile(rq);
-            if (ret == 0) { /* couldn't read file */
-                goto out;
-            }
             
-            pthread_mutex_lock(&cache_lock);
-            /* try to put it in the hash table */
-            if(cache_insert(data)) {
-                cached_file = cache_lookup(data->file_name);
-                cached_file->in_use++;
+            for(int i=0; i<nr_garbage; i++) {
+                file_data_free(garbage[i]);
             }
-            pthread_mutex_unlock(&cache_lock);
-        }
-        /* send file to client */
-        request_sendfile(rq);
-        pthread_mutex_lock(&cache_lock);
-        if(cached_file != NULL) {
-            cached_file->in_use--;
+            free(garbage);
+            trace_span("reclaim", start, stats_now());
+            server_lock(&cache_lock, "cache_lock wait");
+        } while(evicted && !reclaim_exiting && cache->max_cache_size - cache->curr_cache_size < cache_reclaim_target());
+    }
+    pthread_mutex_unlock(&cache_lock);
+    trace_thread_exit();
+    return NULL;
+}
+
+/* release a file that was returned by cache_lookup or cache_insert.
+ * data is the file data used by the request; it is freed if the cache does
+ * not own it. */
+static void cache_release(struct file *cached_file, struct file_data *data) {
+    bool owned = (cached_file != NULL && cached_file->data == data);
+    
+    if(cached_file != NULL) {
+        server_lock(&cache_lock, "cache_lock wait");
+        cached_file->in_use--;
+        if(cached_file->in_use == 0 && cached_file->removed) {
+            cache_free(cached_file);
         }
         pthread_mutex_unlock(&cache_lock);
     }
-out:
-    request_destroy(rq);
-    //file_data_free(data);     for lab 4 we need to uncomment it; for lab 5 we need to comment it
+    if(!owned) {
+        file_data_free(data);
+    }
 }
 
-void *worker_thread_start(void *server) {
-    struct server *sv = (struct server *)server;
+/* with admission, a file that doesn't fit is only let in if it was
+ * requested more often than the file that is evicted first, see admit.c.
+ * Returns true if the file may evict files to make room */
+static bool cache_admit(struct file_data *data, long block, int size) {
+    struct file *victim;
     
-    /* keep doing until the server is exiting */
-    while (1) {
-        pthread_mutex_lock(&lock);
+    if(!admit_enabled() || size <= cache->max_cache_size - cache->curr_cache_size) {
+        return true;
+    }
+    for(victim = LRU->head; victim != NULL && victim->in_use > 0; victim = victim->LRU_next);
+    if(victim == NULL || admit_estimate(data->file_name, block) > admit_estimate(victim->data->file_name, victim->block)) {
+        return true;
+    }
+    return false;
+}
 
-        /* when buffer is empty */
-        while(in == out) {
-            pthread_cond_wait(&empty, &lock);
-               
-            /* when the server is exiting 
-             * all work_threads need to exit */
-            if(sv->exiting) {
+/* returns true if a file that was read from disk when the file had the given
+ * generation would be inserted now, so that a compressed copy is only made
+ * of files that enter the cache */
+static bool cache_will_insert(struct file_data *data, long block, unsigned int generation) {
+    int size = cache_charge_raw(data);
+    
+    return generation == cache_generation(data->file_name) && size <= cache->max_cache_size && cache_admit(data, block, size);
+}
+
+/* with compression on, makes the compressed copy of a whole file that was
+ * read from disk when the file had the given generation. the copy is made
+ * once, when the file enters the cache, and is served to every client that
+ * accepts it, so no deflate is spent on files that don't enter it */
+static void server_compress(struct server *sv, struct file_data *data, unsigned int generation) {
+    bool compress;
+    
+    if(!sv->compress) {
+        return;
+    }
+    server_lock(&cache_lock, "cache_lock wait");
+    compress = cache_will_insert(data, WHOLE_FILE, generation);
+    pthread_mutex_unlock(&cache_lock);
+    if(compress) {
+        request_compressfile(data);
+    }
+}
+
+/* insert a file that was read from disk when the file had the given
+ * generation, unless it has changed since then, or it is not admitted */
+static struct file *cache_insert_fresh(struct file_data *data, long block, unsigned int generation) {
+    int size = cache_charge_raw(data);
+    
+    if(!cache_admit(data, block, size)) {
+        stats_add(STATS_ADMIT_REJECTS, 1);
+        return NULL;
+    }
+    cache_wait_room(size);
+    if(generation != cache_generation(data->file_name)) {
+        return NULL;
+    }
+    return cache_insert(data, block);
+}
+
+/* with a TTL, a file that is older than it is still served, for up to
+ * cache_stale more, while the refresher checks whether it changed.
+ * Returns true if the file is older than that, and has to be read again */
+static bool cache_expired(struct file *file) {
+    struct refresh *r;
+    long age;
+    
+    if(cache_ttl == 0) {
+        return false;
+    }
+    age = stats_now() - file->fetched;
+    if(age < cache_ttl) {
+        return false;
+    }
+    if(age >= cache_ttl + cache_stale) {
+        return true;
+    }
+    stats_add(STATS_STALE_HITS, 1);
+    if(!file->refreshing) {
+        file->refreshing = 1;
+        r = Malloc(sizeof(struct refresh));
+        r->name = strdup(file->data->file_name);
+        r->next = NULL;
+        if(refresh_tail != NULL) {
+            refresh_tail->next = r;
+        } else {
+            refresh_head = r;
+        }
+        refresh_tail = r;
+        pthread_cond_signal(&refresh_work);
+    }
+    return false;
+}
+
+/* counts a hit on a cached file. a mapped file that keeps being hit is part of
+ * the hot set, which is locked in memory as long as it fits in
+ * max_locked_size. Returns true if the caller should lock the file, with
+ * cache_mlock, once it has dropped the cache lock */
+static bool cache_touch(struct file *file) {
+    struct file_data *data = file->data;
+    
+    file->hits++;
+    if(!data->file_mapped || file->locked || file->hits < CACHE_LOCK_HITS ||
+       data->file_size > cache->max_locked_size - cache->locked_size) {
+        return false;
+    }
+    file->locked = 1;
+    cache->locked_size = cache->locked_size + data->file_size;
+    return true;
+}
+
+/* locks the mapping of a file that cache_touch picked, and must still be in
+ * use by the caller. if mlock fails, e.g., because of RLIMIT_MEMLOCK, no more
+ * files are locked */
+static void cache_mlock(struct file *file) {
+    if(mlock(file->data->file_buf, file->data->file_size) == 0) {
+        return;
+    }
+    server_lock(&cache_lock, "cache_lock wait");
+    if(file->locked) {
+        cache->locked_size = cache->locked_size - file->data->file_size;
+        file->locked = 0;
+    }
+    cache->max_locked_size = 0;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/* serves a file of the cold tier, which the caller has in use. the file is
+ * decompressed and moved back to the hot tier. Returns the file data to
+ * serve, which is a private copy if the file doesn't fit in the hot tier */
+static struct file_data *cache_thaw(struct file *file) {
+    struct file_data *data = file->data;
+    struct file_data *copy;
+    char *buf;
+    int ret;
+    
+    /* the compressed copy doesn't change while the file is in use */
+    buf = cache_mem_alloc(data->file_size);
+    if(buf == NULL) {
+        buf = Malloc(data->file_size);
+    }
+    ret = request_decompressfile(data, buf);
+    assert(ret);
+    
+    server_lock(&cache_lock, "cache_lock wait");
+    if(!file->cold) {
+        /* another request thawed it in the meantime */
+        pthread_mutex_unlock(&cache_lock);
+        cache_mem_free(buf);
+        return data;
+    }
+    if(!file->removed && cache_promote(file, buf)) {
+        cache_reclaim_kick();
+        pthread_mutex_unlock(&cache_lock);
+        return data;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    
+    copy = file_data_init();
+    copy->file_name = Malloc(strlen(data->file_name) + 1);
+    strcpy(copy->file_name, data->file_name);
+    copy->file_buf = buf;
+    copy->file_size = data->file_size;
+    copy->file_csum = data->file_csum;
+    copy->file_mtime = data->file_mtime;
+    memcpy(copy->file_etag, data->file_etag, sizeof(copy->file_etag));
+    return copy;
+}
+
+/* checks the file of the request, using the metadata cache so that repeated
+ * requests for the same file, including missing ones, need neither a stat
+ * nor a freshly formatted error. fills data->file_size, or sends the error */
+static int do_server_stat(struct request *rq, struct file_data *data) {
+    struct file_meta meta;
+    unsigned int generation;
+    int ret;
+    
+    if(!meta_cache_lookup(data->file_name, &meta, &generation)) {
+        request_checkfile(data->file_name, &meta);
+        meta_cache_insert(data->file_name, &meta, generation);
+    }
+    ret = request_setmeta(rq, &meta);
+    free(meta.error);
+    return ret;
+}
+
+/* serve a range of a file that is not cached in full, one cache block at a
+ * time, so that only the blocks covering the range are read from disk.
+ * returns where the blocks came from, for the access log */
+static enum access_source do_server_range(struct server *sv, struct request *rq, struct file_data *data) {
+    enum access_source source = ACCESS_HIT;
+    long start = stats_now();
+    long first, last, block, offset;
+    char *range_buf, *dst;
+    
+    /* fills data->file_size without reading the file */
+    if (!do_server_stat(rq, data) || request_range(rq, data->file_size, &first, &last) < 0) {
+        return ACCESS_NONE;
+    }
+    
+    range_buf = Malloc(last - first + 1);
+    dst = range_buf;
+    for(block = first / CACHE_BLOCK_SIZE; block <= last / CACHE_BLOCK_SIZE; block++) {
+        struct file_data *block_data;
+        struct file *cached_block;
+        long block_start = block * CACHE_BLOCK_SIZE;
+        
+        unsigned int generation;
+        
+        server_lock(&cache_lock, "cache_lock wait");
+        cached_block = cache_lookup(data->file_name, block);
+        generation = cache_generation(data->file_name);
+        admit_record(data->file_name, block);
+        /* a block of another version of the file would tear the range */
+        if(cached_block != NULL && (cache_expired(cached_block) || cached_block->data->file_mtime != data->file_mtime)) {
+            cache_discard(cached_block);
+            cached_block = NULL;
+        }
+        if(cached_block != NULL) {
+            cached_block->in_use++;
+            if(cache->policy == CACHE_LRU) {
+                update_LRU(LRU, cached_block);
+            }
+            block_data = cached_block->data;
+            pthread_mutex_unlock(&cache_lock);
+            stats_add(STATS_HITS, 1);
+        } else {
+            int block_size = CACHE_BLOCK_SIZE;
+            int ret;
+            
+            pthread_mutex_unlock(&cache_lock);
+            stats_add(STATS_MISSES, 1);
+            source = ACCESS_MISS;
+            if(block_start + block_size > data->file_size) {
+                block_size = data->file_size - block_start;
+            }
+            block_data = file_data_init();
+            block_data->file_name = Malloc(strlen(data->file_name) + 1);
+            strcpy(block_data->file_name, data->file_name);
+            /* for the refresher to tell whether the block is current */
+            block_data->file_mtime = data->file_mtime;
+            if(sv->cache_mmap) {
+                ret = request_mapblock(rq, block_data, block_start, block_size);
+            } else {
+                block_data->file_buf = cache_mem_alloc(block_size);
+                ret = request_readblock(rq, block_data, block_start, block_size);
+            }
+            if(!ret) {
+                file_data_free(block_data);
+                free(range_buf);
+                return ACCESS_NONE;
+            }
+            
+            server_lock(&cache_lock, "cache_lock wait");
+            cached_block = cache_insert_fresh(block_data, block, generation);
+            if(cached_block != NULL) {
+                cached_block->in_use++;
+            }
+            pthread_mutex_unlock(&cache_lock);
+        }
+        
+        /* copy the part of this block that overlaps the range */
+        offset = (first > block_start) ? first - block_start : 0;
+        long end = (last < block_start + block_data->file_size - 1) ? last - block_start : block_data->file_size - 1;
+        if(!request_copymap(rq, dst, block_data->file_buf + offset, end - offset + 1)) {
+            cache_release(cached_block, block_data);
+            free(range_buf);
+            return ACCESS_NONE;
+        }
+        dst += end - offset + 1;
+        
+        cache_release(cached_block, block_data);
+    }
+    
+    stats_record(STATS_STAGE_READ, stats_now() - start);
+    request_sendrange(rq, range_buf, first, last);
+    free(range_buf);
+    return source;
+}
+
+/* serve the metrics of the server, see stats.c, which are sampled now */
+static void do_server_metrics(struct server *sv, struct request *rq, int json) {
+    struct stats_gauge gauges[10];
+    size_t reserved = 0, used = 0;
+    int nr_gauges = 0;
+    char buf[16384];
+    int size;
+    
+    server_lock(&lock, "queue lock wait");
+    gauges[nr_gauges++] = (struct stats_gauge){"queue_depth", "Requests waiting for a worker.",
+        sv->max_requests > 0 ? (in - out + (sv->max_requests+1)) % (sv->max_requests+1) : 0};
+    pthread_mutex_unlock(&lock);
+    gauges[nr_gauges++] = (struct stats_gauge){"queue_capacity", "Requests that can wait for a worker.", sv->max_requests};
+    gauges[nr_gauges++] = (struct stats_gauge){"worker_threads", "Worker threads.", sv->nr_threads};
+    if(cache != NULL) {
+        server_lock(&cache_lock, "cache_lock wait");
+        gauges[nr_gauges++] = (struct stats_gauge){"cache_bytes", "Bytes used by the hot tier of the cache.", cache->curr_cache_size};
+        gauges[nr_gauges++] = (struct stats_gauge){"cache_capacity_bytes", "Bytes the hot tier of the cache may use.", cache->max_cache_size};
+        gauges[nr_gauges++] = (struct stats_gauge){"cache_cold_bytes", "Bytes used by the cold tier of the cache.", cache->curr_cold_size};
+        gauges[nr_gauges++] = (struct stats_gauge){"cache_entries", "Files and blocks in the cache.", cache->nr_files};
+        gauges[nr_gauges++] = (struct stats_gauge){"cache_locked_bytes", "Bytes of mapped files locked in memory.", cache->locked_size};
+        pthread_mutex_unlock(&cache_lock);
+        cache_mem_stats(&reserved, &used);
+        gauges[nr_gauges++] = (struct stats_gauge){"cache_arena_bytes", "Bytes of the cache arena in use.", (long)used};
+        gauges[nr_gauges++] = (struct stats_gauge){"cache_arena_capacity_bytes", "Bytes reserved for the cache arena.", (long)reserved};
+    }
+    size = stats_format(buf, sizeof(buf), json, gauges, nr_gauges);
+    request_sendbody(rq, json ? "application/json" : "text/plain; version=0.0.4", buf, size);
+}
+
+/* serve the estimated miss ratio curve, see mrc.c */
+static void do_server_mrc(struct server *sv, struct request *rq) {
+    char buf[16384];
+    int size;
+    
+    size = mrc_format(buf, sizeof(buf), sv->max_cache_size);
+    request_sendbody(rq, "text/plain", buf, size);
+}
+
+/* log the request, once its response is sent */
+static void do_server_log(struct request *rq, struct file_data *data, enum access_source source, long accepted) {
+    /* files from the bundle would be served from it at any cache size */
+    if(source != ACCESS_NONE && source != ACCESS_BUNDLE) {
+        mrc_record(data->file_name, data->file_size);
+    }
+    access_log(data->file_name, request_status(rq), request_bytes_sent(rq), source, stats_now() - accepted);
+}
+
+/* entry point functions */
+
+static void do_server_request(struct server *sv, int connfd, long accepted) {
+    enum access_source source = ACCESS_NONE;
+    long start;
+    int ret;
+    long first, last;
+    struct request *rq;
+    struct file_data *data;
+    const char *header;
+    int header_size;
+
+    data = file_data_init();
+
+    /* fill data->file_name with name of the file being requested */
+    start = stats_now();
+    rq = request_init(connfd, data);
+    stats_record(STATS_STAGE_PARSE, stats_now() - start);
+    if (!rq) {
+	file_data_free(data);
+	return;
+    }
+    
+    /* reserved names */
+    if(strcmp(data->file_name, STATS_NAME) == 0 || strcmp(data->file_name, STATS_JSON_NAME) == 0) {
+        do_server_metrics(sv, rq, strcmp(data->file_name, STATS_JSON_NAME) == 0);
+        goto out;
+    }
+    if(strcmp(data->file_name, MRC_NAME) == 0) {
+        do_server_mrc(sv, rq);
+        goto out;
+    }
+    
+    /* files in the bundle are sent straight from it */
+    if(bundle_get(data, &header, &header_size)) {
+        stats_add(STATS_BUNDLE_HITS, 1);
+        source = ACCESS_BUNDLE;
+        if(request_not_modified(rq)) {
+            request_send_not_modified(rq);
+        } else if((ret = request_range(rq, data->file_size, &first, &last)) > 0) {
+            request_sendrange(rq, data->file_buf + first, first, last);
+        } else if(ret == 0) {
+            request_sendfile_header(rq, header, header_size);
+        }
+        /* they belong to the bundle */
+        data->file_buf = NULL;
+        data->file_304 = NULL;
+        goto out;
+    }
+    
+    /* no cache */
+    if(sv->max_cache_size==0){
+        if(request_has_range(rq)) {
+            /* only the requested bytes are read, see request_readblock */
+            if(do_server_stat(rq, data) && request_range(rq, data->file_size, &first, &last) > 0) {
+                struct file_data *range_data = file_data_init();
+                start = stats_now();
+                ret = request_readblock(rq, range_data, first, last - first + 1);
+                stats_record(STATS_STAGE_READ, stats_now() - start);
+                if(ret) {
+                    source = ACCESS_MISS;
+                    request_sendrange(rq, range_data->file_buf, first, last);
+                }
+                file_data_free(range_data);
+            }
+            goto out;
+        }
+        /* read file, 
+         * fills data->file_buf with the file contents,
+         * data->file_size with file size. */
+        start = stats_now();
+        ret = do_server_stat(rq, data) && request_loadfile(rq);
+        stats_record(STATS_STAGE_READ, stats_now() - start);
+        if (ret == 0) { /* couldn't read file */
+            goto out;
+        }    
+        source = ACCESS_MISS;
+        /* send file to client, unless the client's copy is current */
+        if(request_not_modified(rq)) {
+            request_send_not_modified(rq);
+        } else {
+            request_sendfile(rq);
+        }
+    }
+    
+    /* using cache */
+    else {
+        server_lock(&cache_lock, "cache_lock wait");
+        struct file *cached_file = cache_lookup(data->file_name, WHOLE_FILE);
+        unsigned int generation = cache_generation(data->file_name);
+        
+        admit_record(data->file_name, WHOLE_FILE);
+        if(cached_file != NULL && cache_expired(cached_file)) {
+            cache_discard(cached_file);
+            cached_file = NULL;
+        }
+        /* found in the hash table */
+        if(cached_file != NULL) {
+            bool lock_it;
+            bool cold = cached_file->cold;
+            
+            cached_file->in_use++;
+            file_data_free(data);
+            data = cached_file->data;
+            request_set_data(rq, data);
+            
+            /* since we look up the cached file
+             * we need to update its LRU, unless the policy is FIFO */
+            if(cache->policy == CACHE_LRU && !cold) {
+                update_LRU(LRU, cached_file);
+            }
+            lock_it = !cold && cache_touch(cached_file);
+            
+            pthread_mutex_unlock(&cache_lock);
+            stats_add(cold ? STATS_COLD_HITS : STATS_HITS, 1);
+            source = cold ? ACCESS_COLD : ACCESS_HIT;
+            if(lock_it) {
+                cache_mlock(cached_file);
+            }
+            /* the contents are not needed to tell the client its copy is
+             * current, so a cold file is only thawed to be sent */
+            if(cold && !request_not_modified(rq)) {
+                start = stats_now();
+                data = cache_thaw(cached_file);
+                stats_record(STATS_STAGE_READ, stats_now() - start);
+                request_set_data(rq, data);
+            }
+        }
+        
+        /* not found in the hash table, but only a range of it is needed */
+        else if(request_has_range(rq)) {
+            pthread_mutex_unlock(&cache_lock);
+            source = do_server_range(sv, rq, data);
+            goto out;
+        }
+        
+        /* not found in the hash table */
+        else {
+            pthread_mutex_unlock(&cache_lock);
+            stats_add(STATS_MISSES, 1);
+            start = stats_now();
+            ret = do_server_stat(rq, data);
+            if (ret != 0 && spill_get(data)) {
+                /* the copy in the spill file is current */
+                stats_add(STATS_SPILL_HITS, 1);
+                source = ACCESS_SPILL;
+                request_set_etag(data);
+            } else if (ret != 0 && sv->cache_mmap) {
+                ret = request_mapfile(rq);
+            } else if (ret != 0) {
+                /* read it straight into cache memory */
+                if(data->file_size <= sv->max_cache_size) {
+                    data->file_buf = cache_mem_alloc(data->file_size);
+                }
+                ret = request_loadfile(rq);
+            }
+            if (ret == 0) { /* couldn't read file */
+                stats_record(STATS_STAGE_READ, stats_now() - start);
+                goto out;
+            }
+            if(source == ACCESS_NONE) {
+                source = ACCESS_MISS;
+            }
+            server_compress(sv, data, generation);
+            stats_record(STATS_STAGE_READ, stats_now() - start);
+            
+            server_lock(&cache_lock, "cache_lock wait");
+            /* try to put it in the hash table */
+            cached_file = cache_insert_fresh(data, WHOLE_FILE, generation);
+            if(cached_file != NULL) {
+                cached_file->in_use++;
+            }
+            pthread_mutex_unlock(&cache_lock);
+        }
+        /* send file (or the requested range of it) to client.
+         * if the client's copy is current, no processing or body is needed */
+        if(request_not_modified(rq)) {
+            request_send_not_modified(rq);
+            ret = -1;
+        } else {
+            ret = request_range(rq, data->file_size, &first, &last);
+        }
+        if(ret > 0) {
+            request_sendrange(rq, data->file_buf + first, first, last);
+        } else if(ret == 0) {
+            request_sendfile(rq);
+        }
+        do_server_log(rq, data, source, accepted);
+        if(request_map_faulted(rq)) {
+            server_file_changed(data->file_name);
+        }
+        cache_release(cached_file, data);
+        request_destroy(rq);
+        return;
+    }
+out:
+    do_server_log(rq, data, source, accepted);
+    if(request_map_faulted(rq)) {
+        server_file_changed(data->file_name);
+    }
+    request_destroy(rq);
+    file_data_free(data);
+}
+
+void *worker_thread_start(void *arg) {
+    struct worker *worker = (struct worker *)arg;
+    struct server *sv = worker->sv;
+    
+    stats_thread();
+    access_log_thread();
+    trace_thread("worker");
+    
+    /* keep doing until the server is exiting */
+    while (1) {
+        long idle = 0;
+        long start;
+        
+        server_lock(&lock, "queue lock wait");
+
+        /* when buffer is empty */
+        while(in == out && !worker->retire) {
+            /* when the server is exiting 
+             * all work_threads need to exit */
+            if(sv->exiting) {
                 pthread_mutex_unlock(&lock);
                 pthread_exit(0);
             }
+            if(idle == 0) {
+                idle = trace_start();
+            }
+            pthread_cond_wait(&empty, &lock);
+        }
+        
+        /* a worker that is let go exits between requests, and the others
+         * serve the requests that are waiting */
+        if(worker->retire) {
+            pthread_mutex_unlock(&lock);
+            break;
         }
 
-        int curr_connfd = buffer[out];
+        struct queued_request curr = buffer[out];
         out = (out + 1) % (sv->max_requests+1);
         pthread_cond_signal(&full);
         pthread_mutex_unlock(&lock);
+        trace_span("idle", idle, stats_now());
         
-        do_server_request(sv, curr_connfd);
+        start = stats_now();
+        stats_record(STATS_STAGE_QUEUE, start - curr.accepted);
+        do_server_request(sv, curr.connfd, curr.accepted);
+        stats_record(STATS_STAGE_TOTAL, stats_now() - curr.accepted);
+        trace_span("request", start, stats_now());
+    }
+    stats_thread_exit();
+    access_log_thread_exit();
+    trace_thread_exit();
+    return 0;
+}
+
+/* starts worker threads until there are nr_threads of them */
+static void server_start_workers(struct server *sv, int nr_threads) {
+    workers = (struct worker **)Realloc(workers, sizeof(struct worker *) * nr_threads);
+    for(int i=sv->nr_threads; i<nr_threads; i++) {
+        workers[i] = Malloc(sizeof(struct worker));
+        workers[i]->sv = sv;
+        workers[i]->retire = 0;
+        pthread_create(&workers[i]->thread, NULL, worker_thread_start, workers[i]);
+    }
+    sv->nr_threads = nr_threads;
+}
+
+/* stops worker threads until there are nr_threads of them, waiting for the
+ * ones let go to finish the request they are serving */
+static void server_stop_workers(struct server *sv, int nr_threads) {
+    server_lock(&lock, "queue lock wait");
+    for(int i=nr_threads; i<sv->nr_threads; i++) {
+        workers[i]->retire = 1;
+    }
+    pthread_cond_broadcast(&empty);
+    pthread_mutex_unlock(&lock);
+    for(int i=nr_threads; i<sv->nr_threads; i++) {
+        pthread_join(workers[i]->thread, NULL);
+        free(workers[i]);
+    }
+    sv->nr_threads = nr_threads;
+}
+
+/* files that were hit more often come first, and then the most recent */
+static int snapshot_compare(const void *a, const void *b) {
+    const struct warm_file *x = a, *y = b;
+    
+    if(x->hits != y->hits) {
+        return y->hits - x->hits;
+    }
+    return x->rank - y->rank;
+}
+
+/* writes the list of the files in the cache to sv->snapshot_path, hottest
+ * first. the contents are not written, they are read from disk again by
+ * the server that warms up from the snapshot. the workers must be done */
+static void server_snapshot(struct server *sv) {
+    struct warm_file *files;
+    struct LRU_list *lists[] = {LRU, COLD};
+    struct file *file;
+    int nr_files = 0;
+    FILE *out;
+    
+    if(sv->snapshot_path == NULL || (out = fopen(sv->snapshot_path, "w")) == NULL) {
+        return;
+    }
+    files = Malloc(sizeof(struct warm_file) * (cache->nr_files + 1));
+    for(int i=0; i<2; i++) {
+        for(file = lists[i]->tail; file != NULL; file = file->LRU_prev) {
+            if(file->block != WHOLE_FILE) {
+                continue;
+            }
+            files[nr_files].name = file->data->file_name;
+            files[nr_files].csum = file->data->file_csum;
+            files[nr_files].size = file->data->file_size;
+            files[nr_files].mtime = file->data->file_mtime;
+            files[nr_files].hits = file->hits;
+            files[nr_files].rank = nr_files;
+            nr_files++;
+        }
+    }
+    qsort(files, nr_files, sizeof(struct warm_file), snapshot_compare);
+    /* like the index of a file set, see fileset.c */
+    fprintf(out, "%d\n", nr_files);
+    for(int i=0; i<nr_files; i++) {
+        fprintf(out, "%s %u %d %ld %d\n", files[i].name, files[i].csum, files[i].size, files[i].mtime, files[i].hits);
+    }
+    fclose(out);
+    free(files);
+}
+
+/* adds file to the files that the cache is warmed up with, unless it doesn't
+ * fit in the cache anymore */
+static void warm_add(struct warm_file *file) {
+    if(file->size < 0 || warm_size + file->size > cache->max_cache_size) {
+        return;
+    }
+    warm_size += file->size;
+    warm_files = (struct warm_file *)Realloc(warm_files, sizeof(struct warm_file) * (warm_nr_files + 1));
+    warm_files[warm_nr_files] = *file;
+    warm_files[warm_nr_files].name = strdup(file->name);
+    warm_files[warm_nr_files].rank = warm_nr_files;
+    warm_nr_files++;
+}
+
+/* reads the snapshot at path, hottest first */
+static void snapshot_read(char *path) {
+    struct warm_file file = {0};
+    char name[MAXLINE];
+    int n;
+    FILE *in;
+    
+    if((in = fopen(path, "r")) == NULL) {
+        return;
+    }
+    file.name = name;
+    file.csum_known = 1;
+    if(fscanf(in, "%d", &n) == 1) {
+        while(n-- > 0 && fscanf(in, "%4095s %u %d %ld %d", name, &file.csum, &file.size, &file.mtime, &file.hits) == 5) {
+            warm_add(&file);
+        }
+    }
+    fclose(in);
+}
+
+/* without knowing how popular files are, the smallest files come first, so
+ * that the most files fit in the cache, and then the files listed first */
+static int preload_compare(const void *a, const void *b) {
+    const struct warm_file *x = a, *y = b;
+    
+    if(x->size != y->size) {
+        return x->size - y->size;
+    }
+    return x->rank - y->rank;
+}
+
+struct warm_file *preload_files = NULL;
+int preload_nr_files = 0;
+
+static void preload_add(char *name, unsigned int csum, int csum_known, int size) {
+    struct warm_file *file;
+    
+    preload_files = (struct warm_file *)Realloc(preload_files, sizeof(struct warm_file) * (preload_nr_files + 1));
+    file = &preload_files[preload_nr_files];
+    memset(file, 0, sizeof(*file));
+    file->name = Malloc(MAXLINE);
+    /* named like request_init names them, which is without the "./" that
+     * nftw puts in front of the paths under "." */
+    while(strncmp(name, "./", 2) == 0) {
+        name += 2;
+    }
+    request_parse_URI(name, file->name, MAXLINE);
+    file->csum = csum;
+    file->csum_known = csum_known;
+    file->size = size;
+    file->rank = preload_nr_files++;
+}
+
+/* adds a file found by preload_scan */
+static int preload_scan_file(const char *path, const struct stat *sbuf, int type, struct FTW *ftw) {
+    if(type == FTW_F && S_ISREG(sbuf->st_mode) && sbuf->st_size <= INT_MAX) {
+        preload_add((char *)path, 0, 0, sbuf->st_size);
     }
     return 0;
 }
 
-struct server *server_init(int nr_threads, int max_requests, int max_cache_size) {
+/* reads the files to preload from path, which is either an index of a file
+ * set, see fileset.c, whose checksums are used, or a directory to scan */
+static void preload_read(char *path) {
+    struct stat sbuf;
+    char name[MAXLINE];
+    unsigned int csum;
+    int n, size;
+    FILE *in;
+    
+    if(stat(path, &sbuf) < 0) {
+        fprintf(stderr, "preload: %s: %s\n", path, strerror(errno));
+        return;
+    }
+    if(S_ISDIR(sbuf.st_mode)) {
+        nftw(path, preload_scan_file, 16, FTW_PHYS);
+    } else if((in = fopen(path, "r")) != NULL) {
+        if(fscanf(in, "%d", &n) == 1) {
+            while(n-- > 0 && fscanf(in, "%4095s %u %d", name, &csum, &size) == 3) {
+                preload_add(name, csum, 1, size);
+            }
+        }
+        fclose(in);
+    }
+    qsort(preload_files, preload_nr_files, sizeof(struct warm_file), preload_compare);
+    for(int i=0; i<preload_nr_files; i++) {
+        warm_add(&preload_files[i]);
+        free(preload_files[i].name);
+    }
+    free(preload_files);
+    preload_files = NULL;
+    preload_nr_files = 0;
+}
+
+/* puts the warmed up files in the LRU list in the order they were listed,
+ * so that the hottest files are evicted last */
+static void warm_reorder(void) {
+    struct file *file;
+    
+    server_lock(&cache_lock, "cache_lock wait");
+    for(int i=warm_nr_files-1; i>=0; i--) {
+        file = cache_lookup(warm_files[i].name, WHOLE_FILE);
+        if(file != NULL && !file->cold) {
+            update_LRU(LRU, file);
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/* loads the listed files into the cache, until they are all loaded, or time
+ * is up. files that changed since they were listed are left out */
+static void *server_warm_start(void *arg) {
+    struct server *sv = (struct server *)arg;
+    struct warm_file *f;
+    struct file_data *data;
+    struct file_meta meta;
+    struct file *cached_file;
+    unsigned int generation;
+    long long room;
+    int i;
+    
+    while(!sv->exiting && stats_now() < warm_deadline &&
+          (i = __atomic_fetch_add(&warm_next, 1, __ATOMIC_RELAXED)) < warm_nr_files) {
+        f = &warm_files[i];
+        server_lock(&cache_lock, "cache_lock wait");
+        cached_file = cache_lookup(f->name, WHOLE_FILE);
+        generation = cache_generation(f->name);
+        room = cache->max_cache_size - cache->curr_cache_size;
+        pthread_mutex_unlock(&cache_lock);
+        if(cached_file != NULL || f->size > room) {
+            /* a request was faster, or the file doesn't fit anymore */
+            continue;
+        }
+        request_checkfile(f->name, &meta);
+        free(meta.error);
+        if(meta.status != 200 || meta.size != f->size || (f->mtime != 0 && meta.mtime != f->mtime)) {
+            continue;
+        }
+        data = file_data_init();
+        data->file_name = strdup(f->name);
+        data->file_size = f->size;
+        data->file_mtime = meta.mtime;
+        data->file_csum = f->csum;
+        data->file_buf = cache_mem_alloc(data->file_size);
+        if(!request_loaddata(data, !f->csum_known)) {
+            file_data_free(data);
+            continue;
+        }
+        server_compress(sv, data, generation);
+        server_lock(&cache_lock, "cache_lock wait");
+        /* warming up never evicts, since the files that are in the cache
+         * already are the hotter ones. the compressed copy is dropped
+         * if only the file fits */
+        if(cache_charge(NULL, data) > cache->max_cache_size - cache->curr_cache_size) {
+            cache_drop_zbuf(data);
+        }
+        if(cache_charge(NULL, data) > cache->max_cache_size - cache->curr_cache_size) {
+            pthread_mutex_unlock(&cache_lock);
+            file_data_free(data);
+            continue;
+        }
+        cached_file = cache_insert_fresh(data, WHOLE_FILE, generation);
+        if(cached_file != NULL) {
+            cached_file->in_use++;
+            /* the next snapshot ranks it as this one did */
+            if(cached_file->data == data) {
+                cached_file->hits = f->hits;
+            }
+        }
+        pthread_mutex_unlock(&cache_lock);
+        cache_release(cached_file, data);
+    }
+    /* the last loader puts the files in order */
+    if(__atomic_sub_fetch(&warm_running, 1, __ATOMIC_ACQ_REL) == 0) {
+        warm_reorder();
+    }
+    return NULL;
+}
+
+/* warms up the cache, while the server starts serving requests, from the
+ * snapshot at sv->snapshot_path, if there is one, and then from the files
+ * to preload, which may take up to timeout seconds */
+static void server_warm(struct server *sv, char *preload_path, int timeout) {
+    if(sv->snapshot_path != NULL) {
+        snapshot_read(sv->snapshot_path);
+    }
+    if(preload_path != NULL) {
+        preload_read(preload_path);
+    }
+    if(warm_nr_files == 0) {
+        return;
+    }
+    warm_next = 0;
+    warm_running = WARM_LOADERS;
+    warm_deadline = stats_now() + (long)timeout * 1000000000L;
+    for(int i=0; i<WARM_LOADERS; i++) {
+        pthread_create(&warm_threads[i], NULL, server_warm_start, sv);
+    }
+}
+
+/* marks a cached copy of a file as just read, if it is current with meta.
+ * Sets *reload if it is the whole file, which can be read again.
+ * Returns false if it changed */
+static bool cache_revalidate_copy(struct file *file, struct file_meta *meta, bool *reload) {
+    struct file_data *data = file->data;
+    
+    if(file->block == WHOLE_FILE && !data->file_mapped) {
+        *reload = true;
+    }
+    if(meta->status != 200 || data->file_mtime != meta->mtime ||
+       (file->block == WHOLE_FILE && data->file_size != meta->size)) {
+        return false;
+    }
+    file->fetched = stats_now();
+    file->refreshing = 0;
+    return true;
+}
+
+/* marks the cached copies of file_name, hot or cold, as just read, if they
+ * are current with meta. Returns false if any of them changed */
+static bool cache_revalidate(char *file_name, struct file_meta *meta, bool *reload) {
+    struct file *file;
+    bool current = true;
+    
+    for(file = cache->name_table[hash(file_name, WHOLE_FILE)]; file != NULL; file = file->name_next) {
+        if(strcmp(file->data->file_name, file_name) == 0 && !cache_revalidate_copy(file, meta, reload)) {
+            current = false;
+        }
+    }
+    return current;
+}
+
+/* checks whether file_name changed since it was cached. if it did, the whole
+ * file is read again, and replaces the cached copies in one go, so requests
+ * find either the old copy or the new one, and blocks are dropped. the new
+ * copy takes the place of the old one, which was in the cache already, so it
+ * is neither held up by the reclaimer nor subject to admission */
+static void server_refresh(struct server *sv, char *file_name) {
+    struct file_meta meta;
+    struct file_data *data = NULL;
+    struct file *cached_file = NULL;
+    bool current, stale, reload = false;
+    unsigned int generation;
+    long start = trace_start();
+    
+    request_checkfile(file_name, &meta);
+    free(meta.error);
+    server_lock(&cache_lock, "cache_lock wait");
+    current = cache_revalidate(file_name, &meta, &reload);
+    /* taken before the file is read again, like on a miss */
+    generation = cache_generation(file_name);
+    pthread_mutex_unlock(&cache_lock);
+    if(current) {
+        trace_span("refresh", start, stats_now());
+        return;
+    }
+    
+    stats_add(STATS_REFRESHES, 1);
+    if(reload && meta.status == 200 && meta.size < sv->max_cache_size) {
+        data = file_data_init();
+        data->file_name = strdup(file_name);
+        data->file_size = meta.size;
+        data->file_mtime = meta.mtime;
+        data->file_buf = cache_mem_alloc(data->file_size);
+        if(request_loaddata(data, 1)) {
+            server_compress(sv, data, generation);
+        } else {
+            file_data_free(data);
+            data = NULL;
+        }
+    }
+    meta_cache_invalidate(file_name);
+    server_lock(&cache_lock, "cache_lock wait");
+    /* the file changed again while it was read, so the copy may be stale */
+    stale = generation != cache_generation(file_name);
+    cache_invalidate(file_name);
+    spill_invalidate(file_name);
+    if(data != NULL && !stale) {
+        cached_file = cache_insert(data, WHOLE_FILE);
+        if(cached_file != NULL) {
+            cached_file->in_use++;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    if(data != NULL) {
+        cache_release(cached_file, data);
+    }
+    trace_span("refresh", start, stats_now());
+}
+
+/* the refresher checks the files that were served stale, one at a time, off
+ * the request path */
+static void *server_refresh_start(void *arg) {
+    struct server *sv = arg;
+    struct refresh *r;
+    
+    trace_thread("refresher");
+    server_lock(&cache_lock, "cache_lock wait");
+    while(!refresh_exiting) {
+        if(refresh_head == NULL) {
+            pthread_cond_wait(&refresh_work, &cache_lock);
+            continue;
+        }
+        r = refresh_head;
+        refresh_head = r->next;
+        if(refresh_head == NULL) {
+            refresh_tail = NULL;
+        }
+        pthread_mutex_unlock(&cache_lock);
+        
+        server_refresh(sv, r->name);
+        free(r->name);
+        free(r);
+        server_lock(&cache_lock, "cache_lock wait");
+    }
+    pthread_mutex_unlock(&cache_lock);
+    trace_thread_exit();
+    return NULL;
+}
+
+/* waits for the loaders of server_warm */
+static void server_warm_exit(void) {
+    if(warm_nr_files == 0) {
+        return;
+    }
+    for(int i=0; i<WARM_LOADERS; i++) {
+        pthread_join(warm_threads[i], NULL);
+    }
+    for(int i=0; i<warm_nr_files; i++) {
+        free(warm_files[i].name);
+    }
+    free(warm_files);
+    warm_files = NULL;
+    warm_nr_files = 0;
+    warm_size = 0;
+}
+
+struct server *server_init(int nr_threads, int max_requests, long long max_cache_size, struct server_options *opts) {
     struct server *sv;
     
     sv = Malloc(sizeof(struct server));
-    sv->nr_threads = nr_threads;
+    sv->nr_threads = 0;
+    sv->max_threads = nr_threads > MAX_THREADS ? nr_threads : MAX_THREADS;
     sv->max_requests = max_requests;
     sv->max_cache_size = max_cache_size;
+    sv->cache_budget = max_cache_size;
+    sv->cache_mmap = opts->cache_mmap;
+    /* the cold tier keeps only the compressed copies */
+    sv->compress = opts->compress || opts->cold_percent > 0;
+    sv->snapshot_path = opts->snapshot_path;
     sv->exiting = 0;
+    stats_init(sv->max_threads);
+    request_guard_init();
+    access_log_init(opts->access_log, sv->max_threads);
+    trace_init(opts->trace_path, sv->max_threads);
+    bundle_init(opts->bundle_path);
+    mrc_init(opts->mrc_rate, 4 * max_cache_size);
+    
+    /* with the document root watched, cached files and metadata are
+     * dropped when they change on disk, but for the files the server
+     * writes itself */
+    watch_ignore(opts->access_log);
+    watch_ignore(opts->trace_path);
+    watch_ignore(opts->spill_path);
+    watch_ignore(opts->snapshot_path);
+    watch_ignore(HANDOFF_PATH);
+    if(watch_init(".", server_file_changed)) {
+        meta_cache_init(META_CACHE_ENTRIES, META_CACHE_WATCHED_TTL);
+    } else {
+        meta_cache_init(META_CACHE_ENTRIES, META_CACHE_TTL);
+    }
    
     if (nr_threads > 0 || max_requests > 0 || max_cache_size > 0) {
       
         if(nr_threads > 0) {
-            worker_threads = (pthread_t *)malloc(sizeof(pthread_t) * nr_threads);
-            for (int i=0; i<nr_threads; i++) {
-                pthread_create(&(worker_threads[i]), NULL, worker_thread_start, (void *)sv);
-            }
+            server_start_workers(sv, nr_threads);
         }
         
         if(max_requests > 0) {
-            buffer = (int *)malloc(sizeof(int) * (max_requests+1)); // allocate one more due to it's circular, see lecture notes
+            buffer = (struct queued_request *)malloc(sizeof(struct queued_request) * (max_requests+1)); // allocate one more due to it's circular, see lecture notes
         }
         
         if(max_cache_size > 0) {
             cache = (struct cache*)malloc(sizeof(struct cache));
             cache->max_cache_size = max_cache_size;
             cache->curr_cache_size = 0;
-            cache->hash_table_size = (int) (max_cache_size / 10117 * 127);
+            /* the cold tier takes its part of the cache from the hot tier */
+            cache->cold_percent = opts->cold_percent;
+            cache->max_cold_size = max_cache_size * opts->cold_percent / 100;
+            cache->max_cache_size = max_cache_size - cache->max_cold_size;
+            cache->curr_cold_size = 0;
+            cache->nr_files = 0;
+            cache->nr_blocks = 0;
+            memset(cache->generation, 0, sizeof(cache->generation));
+            cache->locked_size = 0;
+            cache->max_locked_size = opts->max_locked_size;
+            cache->policy = CACHE_FIFO;
+            cache->hash_table_size = (int) (max_cache_size / 10117 * 127 < CACHE_MAX_BUCKETS ? max_cache_size / 10117 * 127 : CACHE_MAX_BUCKETS);
+            if(cache->hash_table_size < 1) {
+                cache->hash_table_size = 1;
+            }
             LRU = (struct LRU_list*)malloc(sizeof(struct LRU_list));
             LRU->head = NULL;
+            LRU->tail = NULL;
+            COLD = (struct LRU_list*)malloc(sizeof(struct LRU_list));
+            COLD->head = NULL;
+            COLD->tail = NULL;
             cache->hash_table = (struct file**)malloc(sizeof(struct file*) * cache->hash_table_size);
+            cache->name_table = (struct file**)malloc(sizeof(struct file*) * cache->hash_table_size);
+            /* cached files are read into a region of their own. it is a bit
+             * larger than the cache, for files that are being read in.
+             * mapped files need no memory of their own */
+            if(!sv->cache_mmap) {
+                cache_mem_init((size_t)max_cache_size + max_cache_size / 4);
+            }
             for (int i=0; i<cache->hash_table_size; i++) {
                 cache->hash_table[i] = NULL;
+                cache->name_table[i] = NULL;
+            }
+            /* mapped files share the page cache already */
+            if(opts->dedup && !sv->cache_mmap) {
+                content_init(cache->hash_table_size);
+            }
+            if(opts->admission) {
+                admit_init(cache->hash_table_size, opts->doorkeeper);
+            }
+            spill_init(opts->spill_path, (long long)opts->spill_size * 1024 * 1024);
+            server_warm(sv, opts->preload_path, opts->preload_timeout > 0 ? opts->preload_timeout : WARM_TIMEOUT);
+            if(opts->reclaim_percent > 0) {
+                reclaim_high_percent = opts->reclaim_percent < 100 ? opts->reclaim_percent : 100;
+                reclaim_low_percent = opts->reclaim_low_percent > 0 && opts->reclaim_low_percent <= reclaim_high_percent ? opts->reclaim_low_percent : reclaim_high_percent / 2;
+                reclaim_running = 1;
+                pthread_create(&reclaim_thread, NULL, cache_reclaim_start, NULL);
+            }
+            if(opts->ttl > 0) {
+                cache_ttl = (long)opts->ttl * 1000000000L;
+                cache_stale = (long)(opts->stale >= 0 ? opts->stale : opts->ttl) * 1000000000L;
+            }
+            if(cache_stale > 0) {
+                refresh_running = 1;
+                pthread_create(&refresh_thread, NULL, server_refresh_start, sv);
+            }
+            if(opts->cgroup_path != NULL && pressure_init(opts->cgroup_path)) {
+                sizer_running = 1;
+                pthread_create(&sizer_thread, NULL, server_sizer_start, sv);
             }
         }
     }
@@ -425,27 +2050,369 @@ struct server *server_init(int nr_threads, int max_requests, int max_cache_size)
 }
 
 void server_request(struct server *sv, int connfd) {
+    long accepted = stats_now();
+    
     if (sv->nr_threads == 0) { /* no worker threads */
-	do_server_request(sv, connfd);
+	do_server_request(sv, connfd, accepted);
+	stats_record(STATS_STAGE_TOTAL, stats_now() - accepted);
+	trace_span("request", accepted, stats_now());
     } else {
 	/*  Save the relevant info in a buffer and have one of the
 	 *  worker threads do the work. */
 	//TBD();
         
-        pthread_mutex_lock(&lock);
+        server_lock(&lock, "queue lock wait");
         
         /* buffer is full */
+        long full_start = 0;
         while((in - out + (sv->max_requests+1) ) % (sv->max_requests+1) == sv->max_requests) {
+            if(full_start == 0) {
+                full_start = trace_start();
+            }
             pthread_cond_wait(&full, &lock);
         }
+        trace_span("queue full", full_start, stats_now());
         
-        buffer[in] = connfd;
+        buffer[in].connfd = connfd;
+        buffer[in].accepted = accepted;
         in = (in + 1) % (sv->max_requests+1);
         pthread_cond_signal(&empty);
         pthread_mutex_unlock(&lock);
     }
 }
 
+/* writes out what has been traced so far, see trace.c */
+void server_trace(struct server *sv) {
+    trace_dump();
+}
+
+/* the functions below change the server while it serves requests. they are
+ * called by the main thread, between requests it accepts */
+
+/* resizes the worker pool. Returns 0 if nr_threads is out of range */
+int server_set_threads(struct server *sv, int nr_threads) {
+    if(nr_threads < 0 || nr_threads > sv->max_threads || (nr_threads > 0 && buffer == NULL)) {
+        return 0;
+    }
+    if(nr_threads > sv->nr_threads) {
+        server_start_workers(sv, nr_threads);
+        return 1;
+    }
+    server_stop_workers(sv, nr_threads);
+    
+    /* with no workers left, the requests that were waiting are served by
+     * the main thread */
+    while(sv->nr_threads == 0 && in != out) {
+        struct queued_request curr = buffer[out];
+        out = (out + 1) % (sv->max_requests+1);
+        do_server_request(sv, curr.connfd, curr.accepted);
+        stats_record(STATS_STAGE_TOTAL, stats_now() - curr.accepted);
+    }
+    return 1;
+}
+
+/* resizes the request queue, once the requests waiting in it fit in the new
+ * one. Returns 0 if max_requests is out of range */
+int server_set_requests(struct server *sv, int max_requests) {
+    struct queued_request *new_buffer;
+    int pending = 0;
+    
+    if(max_requests < 1) {
+        return 0;
+    }
+    new_buffer = (struct queued_request *)malloc(sizeof(struct queued_request) * (max_requests+1));
+    server_lock(&lock, "queue lock wait");
+    if(buffer != NULL) {
+        /* the workers make room, so there are some when there are too many */
+        while((pending = (in - out + (sv->max_requests+1)) % (sv->max_requests+1)) > max_requests) {
+            pthread_cond_wait(&full, &lock);
+        }
+        for(int i=0; i<pending; i++) {
+            new_buffer[i] = buffer[(out + i) % (sv->max_requests+1)];
+        }
+        free(buffer);
+    }
+    buffer = new_buffer;
+    out = 0;
+    in = pending;
+    sv->max_requests = max_requests;
+    pthread_mutex_unlock(&lock);
+    return 1;
+}
+
+/* evicts up to CACHE_SHRINK_BATCH files from the tiers that are over their
+ * budget. Returns false when there is nothing more to evict */
+static bool cache_shrink_some(void) {
+    struct file *file, *next_file;
+    int evicted = 0;
+    
+    for(file = LRU->head; file != NULL && cache->curr_cache_size > cache->max_cache_size && evicted < CACHE_SHRINK_BATCH; file = next_file) {
+        next_file = file->LRU_next;
+        if(file->in_use == 0) {
+            cache_demote(file);
+            evicted++;
+        }
+    }
+    for(file = COLD->head; file != NULL && cache->curr_cold_size > cache->max_cold_size && evicted < CACHE_SHRINK_BATCH; file = next_file) {
+        next_file = file->LRU_next;
+        if(file->in_use == 0) {
+            cache_remove(file);
+            stats_add(STATS_COLD_EVICTIONS, 1);
+            evicted++;
+        }
+    }
+    return evicted > 0;
+}
+
+/* changes the size of the cache. when it shrinks, files are evicted a batch
+ * at a time, letting requests use the cache in between. the caller holds
+ * resize_lock */
+static void cache_resize(struct server *sv, long long max_cache_size) {
+    long start;
+    bool more = true;
+    
+    server_lock(&cache_lock, "cache_lock wait");
+    cache->max_cold_size = max_cache_size * cache->cold_percent / 100;
+    cache->max_cache_size = max_cache_size - cache->max_cold_size;
+    pthread_mutex_unlock(&cache_lock);
+    sv->max_cache_size = max_cache_size;
+    
+    while(more) {
+        server_lock(&cache_lock, "cache_lock wait");
+        start = trace_start();
+        more = cache_shrink_some();
+        trace_span("eviction", start, stats_now());
+        pthread_mutex_unlock(&cache_lock);
+    }
+}
+
+/* changes the size of the cache, which is also the most that the sizer lets
+ * the cache grow back to.
+ * Returns 0 if there is no cache, or max_cache_size is out of range */
+int server_set_cache(struct server *sv, long long max_cache_size) {
+    if(cache == NULL || max_cache_size <= 0) {
+        return 0;
+    }
+    pthread_mutex_lock(&resize_lock);
+    sv->cache_budget = max_cache_size;
+    cache_resize(sv, max_cache_size);
+    pthread_mutex_unlock(&resize_lock);
+    return 1;
+}
+
+/* the size the cache should have with the memory of the cgroup at p: a step
+ * smaller when tasks stall on memory, or the cgroup is close to its limit,
+ * and a step larger, up to the budget, once neither is the case */
+static long long server_sizer_target(struct server *sv, struct pressure *p) {
+    long long size = sv->max_cache_size;
+    long long step = sv->cache_budget / SIZER_STEP;
+    long long headroom = 0, free = LLONG_MAX;
+    
+    if(p->max >= 0) {
+        headroom = p->max * SIZER_HEADROOM / 100;
+        free = p->max - p->current;
+    }
+    if(p->stall >= SIZER_STALL_HIGH || free < headroom) {
+        size = size - step;
+        if(size < sv->cache_budget / SIZER_MIN) {
+            size = sv->cache_budget / SIZER_MIN;
+        }
+    } else if(p->stall < SIZER_STALL_LOW && free > 2 * headroom) {
+        /* growing must not take the cgroup below the headroom again */
+        size = size + (step < free - 2 * headroom ? step : free - 2 * headroom);
+        if(size > sv->cache_budget) {
+            size = sv->cache_budget;
+        }
+    }
+    return size;
+}
+
+/* the sizer samples the memory of the cgroup every SIZER_INTERVAL ms, and
+ * resizes the cache a step at a time, so it gives memory back before the
+ * cgroup runs out of it, and takes it again once there is enough */
+static void *server_sizer_start(void *arg) {
+    struct server *sv = arg;
+    struct pressure p;
+    struct timespec deadline;
+    long long size;
+    bool shrink;
+    long start;
+    
+    trace_thread("sizer");
+    pthread_mutex_lock(&resize_lock);
+    while(!sizer_exiting) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += SIZER_INTERVAL / 1000;
+        deadline.tv_nsec += (long)(SIZER_INTERVAL % 1000) * 1000000;
+        if(deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&sizer_wakeup, &resize_lock, &deadline);
+        if(sizer_exiting || !pressure_sample(&p)) {
+            continue;
+        }
+        size = server_sizer_target(sv, &p);
+        if(size == sv->max_cache_size) {
+            continue;
+        }
+        start = trace_start();
+        stats_add(STATS_RESIZES, 1);
+        shrink = size < sv->max_cache_size;
+        cache_resize(sv, size);
+        /* the evicted files are only freed to the region */
+        if(shrink) {
+            cache_mem_trim();
+        }
+        trace_span("resize", start, stats_now());
+    }
+    pthread_mutex_unlock(&resize_lock);
+    trace_thread_exit();
+    return NULL;
+}
+
+/* switches the eviction policy to "lru" or "fifo".
+ * Returns 0 if there is no cache, or the policy is unknown */
+int server_set_policy(struct server *sv, char *policy) {
+    enum cache_policy new_policy;
+    
+    if(strcmp(policy, "lru") == 0) {
+        new_policy = CACHE_LRU;
+    } else if(strcmp(policy, "fifo") == 0) {
+        new_policy = CACHE_FIFO;
+    } else {
+        return 0;
+    }
+    if(cache == NULL) {
+        return 0;
+    }
+    server_lock(&cache_lock, "cache_lock wait");
+    cache->policy = new_policy;
+    pthread_mutex_unlock(&cache_lock);
+    return 1;
+}
+
+/* drops the file at path, as in the URI of a request, from the caches, or
+ * every file when path is NULL */
+void server_purge(struct server *sv, char *path) {
+    char file_name[MAXLINE];
+    
+    if(path == NULL) {
+        server_file_changed(NULL);
+        return;
+    }
+    request_parse_URI(path, file_name, sizeof(file_name));
+    server_file_changed(file_name);
+}
+
+/* passes the files in the cache on to the server that takes over, over sock,
+ * from the least to the most recently used, and closes sock. files of the
+ * cold tier are left out, since they would have to be decompressed */
+void server_handoff(struct server *sv, int sock) {
+    struct handoff_file header;
+    struct file **files = NULL;
+    struct file *file;
+    int nr_files = 0;
+    bool ok = true;
+    
+    if(cache != NULL) {
+        server_lock(&cache_lock, "cache_lock wait");
+        files = Malloc(sizeof(struct file *) * (cache->nr_files + 1));
+        for(file = LRU->head; file != NULL; file = file->LRU_next) {
+            if(file->block == WHOLE_FILE && file->data->file_buf != NULL) {
+                file->in_use++;
+                files[nr_files++] = file;
+            }
+        }
+        pthread_mutex_unlock(&cache_lock);
+    }
+    /* the files are in use, so they stay as they are while they are sent */
+    for(int i=0; i<nr_files; i++) {
+        struct file_data *data = files[i]->data;
+        
+        if(ok) {
+            header.name_size = strlen(data->file_name) + 1;
+            header.file_size = data->file_size;
+            header.mtime = data->file_mtime;
+            header.csum = data->file_csum;
+            ok = handoff_write(sock, &header, sizeof(header)) &&
+                handoff_write(sock, data->file_name, header.name_size) &&
+                handoff_write(sock, data->file_buf, data->file_size);
+        }
+        cache_release(files[i], data);
+    }
+    memset(&header, 0, sizeof(header));
+    if(ok) {
+        handoff_write(sock, &header, sizeof(header));
+    }
+    free(files);
+    SYS(close(sock));
+}
+
+/* reads the files that the old server passes on, and caches the ones that
+ * haven't changed on disk since it read them */
+static void *server_takeover_start(void *arg) {
+    struct server *sv = (struct server *)arg;
+    struct handoff_file header;
+    struct file_data *data;
+    struct file_meta meta;
+    struct file *cached_file;
+    unsigned int generation;
+    
+    while(handoff_read(takeover_sock, &header, sizeof(header)) && header.name_size > 0) {
+        if(header.name_size > MAXLINE || header.file_size < 0) {
+            break;
+        }
+        data = file_data_init();
+        data->file_name = Malloc(header.name_size);
+        data->file_size = header.file_size;
+        data->file_mtime = header.mtime;
+        data->file_csum = header.csum;
+        if((data->file_buf = cache_mem_alloc(header.file_size)) == NULL) {
+            data->file_buf = Malloc(header.file_size);
+        }
+        if(!handoff_read(takeover_sock, data->file_name, header.name_size) ||
+           !handoff_read(takeover_sock, data->file_buf, header.file_size)) {
+            file_data_free(data);
+            break;
+        }
+        data->file_name[header.name_size - 1] = '\0';
+        
+        server_lock(&cache_lock, "cache_lock wait");
+        generation = cache_generation(data->file_name);
+        pthread_mutex_unlock(&cache_lock);
+        request_checkfile(data->file_name, &meta);
+        free(meta.error);
+        if(meta.status != 200 || meta.size != data->file_size || meta.mtime != data->file_mtime) {
+            file_data_free(data);
+            continue;
+        }
+        request_set_etag(data);
+        server_compress(sv, data, generation);
+        
+        server_lock(&cache_lock, "cache_lock wait");
+        cached_file = cache_insert_fresh(data, WHOLE_FILE, generation);
+        if(cached_file != NULL) {
+            cached_file->in_use++;
+        }
+        pthread_mutex_unlock(&cache_lock);
+        cache_release(cached_file, data);
+    }
+    SYS(close(takeover_sock));
+    return NULL;
+}
+
+/* takes over the cache of the old server, which sends it over sock, while
+ * this server starts serving requests */
+void server_takeover(struct server *sv, int sock) {
+    if(cache == NULL) {
+        SYS(close(sock));
+        return;
+    }
+    takeover_sock = sock;
+    pthread_create(&takeover_thread, NULL, server_takeover_start, sv);
+}
+
 void server_exit(struct server *sv) {
     /* when using one or more worker threads, use sv->exiting to indicate to
      * these threads that the server is exiting. make sure to call
@@ -453,17 +2420,28 @@ void server_exit(struct server *sv) {
      * for all the worker threads to exit before exiting. */
     sv->exiting = 1;
 
+    /* stop watching before the cache goes away */
+    watch_exit();
+    if(takeover_sock >= 0) {
+        pthread_join(takeover_thread, NULL);
+        takeover_sock = -1;
+    }
+    server_warm_exit();
+    
     /* wakeup all the worker threads */
+    pthread_mutex_lock(&lock);
     pthread_cond_broadcast(&empty);
+    pthread_mutex_unlock(&lock);
     
     /* make sure to free any allocated resources */
     if(sv->nr_threads > 0) {
         for(int i=0; i<sv->nr_threads; i++) {
-            pthread_join(worker_threads[i], NULL);
+            pthread_join(workers[i]->thread, NULL);
+            free(workers[i]);
             //printf("erase worker_thread %d\n", i);
         }
-        free(worker_threads);
-        worker_threads = NULL;
+        free(workers);
+        workers = NULL;
     }
     
     if(sv->max_requests > 0) {
@@ -472,30 +2450,76 @@ void server_exit(struct server *sv) {
     }
     
     if(sv->max_cache_size > 0) {
-        /* free cache */
-        for(int i=0; i<cache->hash_table_size; i++) {
-            if(cache->hash_table[i] != NULL) {
-                file_data_free(cache->hash_table[i]->data);
-                cache->hash_table[i]->data = NULL;
-                free(cache->hash_table[i]);
-                cache->hash_table[i]=NULL;
+        if(refresh_running) {
+            pthread_mutex_lock(&cache_lock);
+            refresh_exiting = 1;
+            pthread_cond_signal(&refresh_work);
+            pthread_mutex_unlock(&cache_lock);
+            pthread_join(refresh_thread, NULL);
+            refresh_running = 0;
+            while(refresh_head != NULL) {
+                struct refresh *r = refresh_head;
+                refresh_head = r->next;
+                free(r->name);
+                free(r);
             }
+            refresh_tail = NULL;
         }
+        if(sizer_running) {
+            pthread_mutex_lock(&resize_lock);
+            sizer_exiting = 1;
+            pthread_cond_signal(&sizer_wakeup);
+            pthread_mutex_unlock(&resize_lock);
+            pthread_join(sizer_thread, NULL);
+            sizer_running = 0;
+            pressure_exit();
+        }
+        if(reclaim_running) {
+            pthread_mutex_lock(&cache_lock);
+            reclaim_exiting = 1;
+            pthread_cond_signal(&reclaim_work);
+            pthread_cond_broadcast(&reclaim_done);
+            pthread_mutex_unlock(&cache_lock);
+            pthread_join(reclaim_thread, NULL);
+            reclaim_running = 0;
+            free(reclaim_garbage);
+            reclaim_garbage = NULL;
+        }
+        server_snapshot(sv);
+        
+        /* free cache, this also empties the LRU list */
+        while(LRU->head != NULL) {
+            cache_remove(LRU->head);
+        }
+        while(COLD->head != NULL) {
+            cache_remove(COLD->head);
+        }
+        content_exit();
+        admit_exit();
+        spill_exit();
         
         free(cache->hash_table);
         cache->hash_table = NULL;
+        free(cache->name_table);
+        cache->name_table = NULL;
+        cache_mem_exit();
         free(cache);
         cache = NULL;
                 
         /* free LRU */
-        while(1){
-            if(dequeue_head(LRU) == -1){
-                break;
-            }
-        }
         free(LRU);
         LRU = NULL;
+        free(COLD);
+        COLD = NULL;
     }
     
+    meta_cache_exit();
+    bundle_exit();
+    mrc_exit();
+    /* the workers are done, so the rest of the log can be written */
+    access_log_exit();
+    trace_exit();
+    stats_dump(stderr);
+    stats_exit();
     free(sv);
 }
\ No newline at end of file
@@ -3,9 +3,53 @@
 
 struct server;
 
+/* optional features of the server, see server.c for the options */
+struct server_options {
+	int cache_mmap;		/* cache read-only mappings of files */
+	int max_locked_size;	/* bytes of hot mapped files to mlock */
+	int cold_percent;	/* part of the cache that holds files
+				 * compressed, in percent */
+	int compress;		/* keep a compressed copy of cached files */
+	char *spill_path;	/* spill file (or directory) for evicted files */
+	int spill_size;		/* size of the spill file, in MB */
+	char *access_log;	/* access log file, see access_log.c */
+	char *trace_path;	/* trace file, see trace.c */
+	char *snapshot_path;	/* list of the cached files, written on exit
+				 * and warmed up from on start */
+	char *preload_path;	/* fileset index, or directory, to preload */
+	int preload_timeout;	/* seconds that preloading may take */
+	char *bundle_path;	/* bundle that files are served from, see
+				 * bundle.c */
+	int dedup;		/* keep identical files once, see content.c */
+	int reclaim_percent;	/* free space, in percent of the cache, that
+				 * a background thread evicts files up to */
+	int reclaim_low_percent;	/* free space below which it starts */
+	int admission;		/* admit files by how often they are
+				 * requested, see admit.c */
+	int doorkeeper;		/* and keep files requested once out of the
+				 * counts */
+	char *cgroup_path;	/* cgroup v2 whose memory the size of the
+				 * cache follows, see pressure.c */
+	int ttl;		/* seconds that cached files are served
+				 * without checking them, 0 for ever */
+	int stale;		/* seconds after that, that they are served
+				 * while they are checked, -1 for the ttl */
+	int mrc_rate;		/* one in this many files is sampled for the
+				 * miss ratio curve, see mrc.c */
+};
+
 struct server *server_init(int nr_threads, int max_requests, 
-			   int max_cache_size);
+			   long long max_cache_size,
+			   struct server_options *opts);
 void server_request(struct server *sv, int connfd);
+void server_trace(struct server *sv);
+int server_set_threads(struct server *sv, int nr_threads);
+int server_set_requests(struct server *sv, int max_requests);
+int server_set_cache(struct server *sv, long long max_cache_size);
+int server_set_policy(struct server *sv, char *policy);
+void server_purge(struct server *sv, char *path);
+void server_handoff(struct server *sv, int sock);
+void server_takeover(struct server *sv, int sock);
 void server_exit(struct server *sv);
 
 #endif /* __SERVER_THREAD_H__ */
@@ -0,0 +1,349 @@
+/*
+ * spill.c: A second level cache of files on a local disk, for files that are
+ * evicted from the memory cache, so that they don't have to be read from the
+ * (slow) document root again.
+ *
+ * The spill file is a log. Files are appended at the head of the log, which
+ * wraps around at the end of the file, overwriting the oldest files, so the
+ * spill file is evicted in FIFO order and is written sequentially. The index
+ * of the log is kept in memory only, so the spill file starts out empty.
+ *
+ * Files are handed over by spill_put and written out by a background thread,
+ * so evicting a file from the memory cache doesn't wait for the disk.
+ */
+
+#define _GNU_SOURCE	/* for O_TMPFILE */
+#include "common.h"
+#include "request.h"
+#include "cache_mem.h"
+#include "csum.h"
+#include "spill.h"
+
+#define SPILL_TABLE_SIZE 4096
+/* files waiting to be written out are dropped beyond this many bytes */
+#define SPILL_MAX_PENDING (8 * 1024 * 1024)
+
+struct spill_entry {
+	char *file_name;
+	int size;
+	unsigned int csum;
+	time_t mtime;
+	long long offset;		/* in the spill file */
+	unsigned long seq;		/* tells apart entries of the same file */
+	int ready;			/* written out, can be read */
+	int pending;			/* owned by the writer until written */
+	int dropped;			/* dropped while pending */
+	char *buf;			/* the file, until it is written */
+	struct spill_entry *next;	/* next entry in the same hash bucket */
+	struct spill_entry *log_prev;	/* entries in log order, oldest first */
+	struct spill_entry *log_next;
+	struct spill_entry *queue_next;	/* next entry to write */
+};
+
+static pthread_mutex_t spill_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t spill_work = PTHREAD_COND_INITIALIZER;
+static pthread_t spill_thread;
+static int spill_fd = -1;
+static int spill_exiting = 0;
+static long long spill_max_size = 0;
+static long long spill_head = 0;	/* where the next file is written */
+static unsigned long spill_seq = 0;
+static long spill_pending = 0;		/* bytes waiting to be written */
+static struct spill_entry *spill_table[SPILL_TABLE_SIZE];
+static struct spill_entry *log_head = NULL;	/* oldest */
+static struct spill_entry *log_tail = NULL;	/* newest */
+static struct spill_entry *queue_head = NULL;
+static struct spill_entry *queue_tail = NULL;
+
+/* djb2 hash function */
+static unsigned long
+spill_hash(char *str)
+{
+	unsigned long hash = 5381;
+	int c;
+
+	while ((c = *str++))
+		hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+	return hash % SPILL_TABLE_SIZE;
+}
+
+static struct spill_entry *
+spill_find(char *file_name)
+{
+	struct spill_entry *e = spill_table[spill_hash(file_name)];
+
+	while (e != NULL && strcmp(e->file_name, file_name) != 0) {
+		e = e->next;
+	}
+	return e;
+}
+
+static void
+spill_free(struct spill_entry *e)
+{
+	free(e->file_name);
+	free(e);
+}
+
+/* unlinks an entry from its hash bucket and the log, and frees it unless the
+ * writer still owns it */
+static void
+spill_drop(struct spill_entry *e)
+{
+	struct spill_entry **prev = &spill_table[spill_hash(e->file_name)];
+
+	while (*prev != e) {
+		prev = &(*prev)->next;
+	}
+	*prev = e->next;
+	if (e->log_prev)
+		e->log_prev->log_next = e->log_next;
+	else
+		log_head = e->log_next;
+	if (e->log_next)
+		e->log_next->log_prev = e->log_prev;
+	else
+		log_tail = e->log_prev;
+	if (e->pending)
+		e->dropped = 1;
+	else
+		spill_free(e);
+}
+
+/* makes room for size bytes at the head of the log, dropping the oldest
+ * entries that would be overwritten. Returns the offset of the room */
+static long long
+spill_reserve(int size)
+{
+	long long offset;
+
+	if (spill_head + size > spill_max_size) {
+		/* the end of the file is too small, wrap around */
+		while (log_head && log_head->offset >= spill_head) {
+			spill_drop(log_head);
+		}
+		spill_head = 0;
+	}
+	/* the oldest entries are just ahead of the head */
+	while (log_head && log_head->offset >= spill_head &&
+	       log_head->offset < spill_head + size) {
+		spill_drop(log_head);
+	}
+	offset = spill_head;
+	spill_head += size;
+	return offset;
+}
+
+static void *
+spill_writer(void *arg)
+{
+	struct spill_entry *e;
+	ssize_t n;
+
+	pthread_mutex_lock(&spill_lock);
+	while (1) {
+		while (queue_head == NULL && !spill_exiting) {
+			pthread_cond_wait(&spill_work, &spill_lock);
+		}
+		if (queue_head == NULL) {
+			break;
+		}
+		e = queue_head;
+		queue_head = e->queue_next;
+		if (queue_head == NULL)
+			queue_tail = NULL;
+		/* the log is written in order, so an entry that is written
+		 * later overwrites an older one that it replaced */
+		if (!e->dropped) {
+			pthread_mutex_unlock(&spill_lock);
+			n = pwrite(spill_fd, e->buf, e->size, e->offset);
+			pthread_mutex_lock(&spill_lock);
+			if (n != e->size && !e->dropped) {
+				spill_drop(e);
+			}
+		}
+		spill_pending -= e->size;
+		cache_mem_free(e->buf);
+		e->buf = NULL;
+		e->pending = 0;
+		if (e->dropped) {
+			spill_free(e);
+		} else {
+			e->ready = 1;
+		}
+	}
+	pthread_mutex_unlock(&spill_lock);
+	return NULL;
+}
+
+/* opens the spill file at path, or an anonymous spill file in path when it
+ * is a directory, and starts the writer.
+ * Returns 1 on success, 0 if spilling is not possible. */
+int
+spill_init(char *path, long long max_size)
+{
+	struct stat sb;
+
+	if (path == NULL || max_size <= 0)
+		return 0;
+	if (stat(path, &sb) == 0 && S_ISDIR(sb.st_mode)) {
+		spill_fd = open(path, O_TMPFILE | O_RDWR, 0600);
+	} else {
+		spill_fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0600);
+	}
+	if (spill_fd < 0) {
+		fprintf(stderr, "spill: %s: %s\n", path, strerror(errno));
+		return 0;
+	}
+	spill_max_size = max_size;
+	spill_exiting = 0;
+	memset(spill_table, 0, sizeof(spill_table));
+	pthread_create(&spill_thread, NULL, spill_writer, NULL);
+	return 1;
+}
+
+/* hands over the contents of a file that is evicted from the memory cache.
+ * Returns 1 if the spill file takes data->file_buf, which it frees with
+ * cache_mem_free. Returns 0 if the caller keeps it, e.g., because the file is
+ * already spilled. */
+int
+spill_put(struct file_data *data)
+{
+	struct spill_entry *e;
+
+	if (spill_fd < 0 || data->file_buf == NULL ||
+	    data->file_size > spill_max_size / 8)
+		return 0;
+	pthread_mutex_lock(&spill_lock);
+	e = spill_find(data->file_name);
+	if (e && e->size == data->file_size && e->mtime == data->file_mtime &&
+	    e->csum == data->file_csum) {
+		pthread_mutex_unlock(&spill_lock);
+		return 0;
+	}
+	if (e) {
+		spill_drop(e);
+	}
+	if (spill_pending + data->file_size > SPILL_MAX_PENDING) {
+		/* the disk can't keep up */
+		pthread_mutex_unlock(&spill_lock);
+		return 0;
+	}
+	e = Malloc(sizeof(struct spill_entry));
+	e->file_name = Malloc(strlen(data->file_name) + 1);
+	strcpy(e->file_name, data->file_name);
+	e->size = data->file_size;
+	e->csum = data->file_csum;
+	e->mtime = data->file_mtime;
+	e->offset = spill_reserve(e->size);
+	e->seq = ++spill_seq;
+	e->ready = 0;
+	e->pending = 1;
+	e->dropped = 0;
+	e->buf = data->file_buf;
+
+	e->next = spill_table[spill_hash(e->file_name)];
+	spill_table[spill_hash(e->file_name)] = e;
+	e->log_prev = log_tail;
+	e->log_next = NULL;
+	if (log_tail)
+		log_tail->log_next = e;
+	else
+		log_head = e;
+	log_tail = e;
+	e->queue_next = NULL;
+	if (queue_tail)
+		queue_tail->queue_next = e;
+	else
+		queue_head = e;
+	queue_tail = e;
+	spill_pending += e->size;
+	pthread_cond_signal(&spill_work);
+	pthread_mutex_unlock(&spill_lock);
+	return 1;
+}
+
+/* reads the file named data->file_name back from the spill file, if it is
+ * there with the size and modification time in data.
+ * Returns 1 and fills data->file_buf and data->file_csum on success. */
+int
+spill_get(struct file_data *data)
+{
+	struct spill_entry *e;
+	long long offset;
+	unsigned long seq;
+	unsigned int csum;
+	char *buf;
+	ssize_t n;
+
+	if (spill_fd < 0 || data->file_size == 0)
+		return 0;
+	pthread_mutex_lock(&spill_lock);
+	e = spill_find(data->file_name);
+	if (e == NULL || !e->ready || e->size != data->file_size ||
+	    e->mtime != data->file_mtime) {
+		pthread_mutex_unlock(&spill_lock);
+		return 0;
+	}
+	offset = e->offset;
+	seq = e->seq;
+	csum = e->csum;
+	pthread_mutex_unlock(&spill_lock);
+
+	if ((buf = cache_mem_alloc(data->file_size)) == NULL)
+		buf = Malloc(data->file_size);
+	n = pread(spill_fd, buf, data->file_size, offset);
+
+	/* entries are dropped before they are overwritten, so the read is
+	 * good if the entry is still there */
+	pthread_mutex_lock(&spill_lock);
+	e = spill_find(data->file_name);
+	if (e == NULL || e->seq != seq) {
+		n = -1;
+	}
+	pthread_mutex_unlock(&spill_lock);
+	if (n != data->file_size || csum_bytes(buf, n) != csum) {
+		cache_mem_free(buf);
+		return 0;
+	}
+	data->file_buf = buf;
+	data->file_csum = csum;
+	return 1;
+}
+
+/* drops file_name (or all files, when it is NULL) because it changed */
+void
+spill_invalidate(char *file_name)
+{
+	struct spill_entry *e;
+
+	if (spill_fd < 0)
+		return;
+	pthread_mutex_lock(&spill_lock);
+	if (file_name == NULL) {
+		while (log_head) {
+			spill_drop(log_head);
+		}
+	} else if ((e = spill_find(file_name)) != NULL) {
+		spill_drop(e);
+	}
+	pthread_mutex_unlock(&spill_lock);
+}
+
+/* waits for the pending writes, and closes the spill file */
+void
+spill_exit(void)
+{
+	if (spill_fd < 0)
+		return;
+	pthread_mutex_lock(&spill_lock);
+	spill_exiting = 1;
+	pthread_cond_signal(&spill_work);
+	pthread_mutex_unlock(&spill_lock);
+	pthread_join(spill_thread, NULL);
+	while (log_head) {
+		spill_drop(log_head);
+	}
+	SYS(close(spill_fd));
+	spill_fd = -1;
+}
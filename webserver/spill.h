@@ -0,0 +1,12 @@
+#ifndef __SPILL_H__
+#define __SPILL_H__
+
+struct file_data;
+
+int spill_init(char *path, long long max_size);
+int spill_put(struct file_data *data);
+int spill_get(struct file_data *data);
+void spill_invalidate(char *file_name);
+void spill_exit(void);
+
+#endif /* __SPILL_H__ */
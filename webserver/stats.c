@@ -0,0 +1,396 @@
+/*
+ * stats.c: Counters of what the server does, served at STATS_NAME in the
+ * Prometheus text format, and at STATS_JSON_NAME as JSON.
+ *
+ * Each thread counts in a slot of its own, on its own cache line, so counting
+ * needs neither a lock nor a shared cache line. The slots are only summed up
+ * when the metrics are requested.
+ *
+ * The latency of each stage of a request is recorded in a histogram with
+ * log-linear buckets, as in HDR histograms: each power of two is split into
+ * 2^STATS_SUB_BITS buckets, so a bucket is off by at most 12.5%, and a
+ * histogram covers from 1 ns to minutes in a few hundred buckets.
+ */
+
+#include "common.h"
+#include "stats.h"
+#include "trace.h"
+
+#define STATS_SUB_BITS 3
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+/* latencies are cut off at 2^STATS_MAX_BITS ns, about 18 minutes */
+#define STATS_MAX_BITS 40
+#define STATS_BUCKETS ((STATS_MAX_BITS - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS)
+
+struct stats_slot {
+	long counter[STATS_NR_COUNTERS];
+	long hist[STATS_NR_STAGES][STATS_BUCKETS];
+	long hist_sum[STATS_NR_STAGES];		/* in ns */
+	int owned;				/* by a worker */
+} __attribute__((aligned(64)));
+
+static char *stats_stage_names[STATS_NR_STAGES] = {
+	[STATS_STAGE_QUEUE] = "queue",
+	[STATS_STAGE_PARSE] = "parse",
+	[STATS_STAGE_READ] = "read",
+	[STATS_STAGE_PROCESS] = "process",
+	[STATS_STAGE_SEND] = "send",
+	[STATS_STAGE_TOTAL] = "total",
+};
+
+/* the quantiles that are reported */
+static const double stats_quantiles[] = {0.5, 0.9, 0.99, 0.999};
+#define STATS_NR_QUANTILES \
+	((int)(sizeof(stats_quantiles) / sizeof(stats_quantiles[0])))
+
+struct stats_name {
+	char *name;	/* of the Prometheus metric, without the prefix */
+	char *label;	/* the code label, for responses */
+	char *key;	/* in the JSON object */
+	char *help;
+};
+
+static const struct stats_name stats_names[STATS_NR_COUNTERS] = {
+	[STATS_REQUESTS] = {"requests_total", NULL, "requests",
+			    "Requests handled."},
+	[STATS_RESPONSES_2XX] = {"responses_total", "2xx", "responses_2xx",
+				 "Responses sent, by status class."},
+	[STATS_RESPONSES_3XX] = {"responses_total", "3xx", "responses_3xx",
+				 NULL},
+	[STATS_RESPONSES_4XX] = {"responses_total", "4xx", "responses_4xx",
+				 NULL},
+	[STATS_RESPONSES_5XX] = {"responses_total", "5xx", "responses_5xx",
+				 NULL},
+	[STATS_BYTES_SENT] = {"sent_bytes_total", NULL, "sent_bytes",
+			      "Bytes sent, headers included."},
+	[STATS_HITS] = {"cache_hits_total", NULL, "cache_hits",
+			"Files and blocks found in the cache."},
+	[STATS_MISSES] = {"cache_misses_total", NULL, "cache_misses",
+			  "Files and blocks not found in the cache."},
+	[STATS_COLD_HITS] = {"cache_cold_hits_total", NULL, "cache_cold_hits",
+			     "Hits on compressed files of the cold tier."},
+	[STATS_SPILL_HITS] = {"spill_hits_total", NULL, "spill_hits",
+			      "Misses read back from the spill file."},
+	[STATS_BUNDLE_HITS] = {"bundle_hits_total", NULL, "bundle_hits",
+			       "Files served from the bundle."},
+	[STATS_DEDUP_HITS] = {"cache_dedup_hits_total", NULL, "cache_dedup_hits",
+			      "Files cached with the contents of another file."},
+	[STATS_RECLAIM_WAITS] = {"cache_reclaim_waits_total", NULL,
+				 "cache_reclaim_waits",
+				 "Inserts that waited for the reclaimer to make room."},
+	[STATS_ADMIT_REJECTS] = {"cache_admission_rejects_total", NULL,
+				 "cache_admission_rejects",
+				 "Files kept out of the cache by admission."},
+	[STATS_RESIZES] = {"cache_resizes_total", NULL, "cache_resizes",
+			   "Times the cache was resized for memory pressure."},
+	[STATS_STALE_HITS] = {"cache_stale_hits_total", NULL,
+			      "cache_stale_hits",
+			      "Hits on files past their ttl, served while they are checked."},
+	[STATS_REFRESHES] = {"cache_refreshes_total", NULL, "cache_refreshes",
+			     "Files that the refresher found changed."},
+	[STATS_EVICTIONS] = {"cache_evictions_total", NULL, "cache_evictions",
+			     "Files and blocks evicted from the cache."},
+	[STATS_COLD_EVICTIONS] = {"cache_cold_evictions_total", NULL,
+				  "cache_cold_evictions",
+				  "Files evicted from the cold tier."},
+	[STATS_LOG_DROPS] = {"access_log_dropped_total", NULL,
+			     "access_log_dropped",
+			     "Access log records dropped under overload."},
+};
+
+#define STATS_PREFIX "webserver_"
+
+static struct stats_slot *stats_slots = NULL;
+static int stats_nr_slots = 0;
+/* the slot of this thread. threads that don't call stats_thread share the
+ * first slot, which is safe but slower */
+static __thread int stats_slot = 0;
+
+/* sets up a slot for the main thread and each of nr_threads workers */
+void
+stats_init(int nr_threads)
+{
+	stats_nr_slots = nr_threads + 1;
+	stats_slots = Malloc(sizeof(struct stats_slot) * stats_nr_slots);
+	memset(stats_slots, 0, sizeof(struct stats_slot) * stats_nr_slots);
+}
+
+/* gives the calling worker thread a slot of its own, if one is free. the
+ * counts in the slot of a worker that exited are kept */
+void
+stats_thread(void)
+{
+	int i, owned;
+
+	for (i = 1; i < stats_nr_slots; i++) {
+		owned = 0;
+		if (__atomic_compare_exchange_n(&stats_slots[i].owned, &owned, 1,
+						0, __ATOMIC_ACQUIRE,
+						__ATOMIC_RELAXED)) {
+			stats_slot = i;
+			return;
+		}
+	}
+	stats_slot = 0;
+}
+
+/* gives up the slot of the calling worker thread, which is exiting */
+void
+stats_thread_exit(void)
+{
+	if (stats_slot > 0)
+		__atomic_store_n(&stats_slots[stats_slot].owned, 0,
+				 __ATOMIC_RELEASE);
+	stats_slot = 0;
+}
+
+void
+stats_add(enum stats_counter counter, long n)
+{
+	if (stats_slots == NULL)
+		return;
+	__atomic_fetch_add(&stats_slots[stats_slot].counter[counter], n,
+			   __ATOMIC_RELAXED);
+}
+
+/* counts a request, once its response has been sent */
+void
+stats_request(int status, long bytes_sent)
+{
+	stats_add(STATS_REQUESTS, 1);
+	if (status >= 200 && status < 600) {
+		stats_add(STATS_RESPONSES_2XX + status / 100 - 2, 1);
+	}
+	stats_add(STATS_BYTES_SENT, bytes_sent);
+}
+
+/* current time in ns, not affected by changes to the system time */
+long
+stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static int
+stats_bucket(unsigned long ns)
+{
+	int msb;
+
+	if (ns < STATS_SUB_BUCKETS)
+		return ns;
+	msb = 63 - __builtin_clzl(ns);
+	if (msb >= STATS_MAX_BITS)
+		return STATS_BUCKETS - 1;
+	return ((msb - STATS_SUB_BITS + 1) << STATS_SUB_BITS) +
+		((ns >> (msb - STATS_SUB_BITS)) & (STATS_SUB_BUCKETS - 1));
+}
+
+/* the largest latency that falls in bucket b */
+static long
+stats_bucket_max(int b)
+{
+	int msb;
+
+	if (b < STATS_SUB_BUCKETS)
+		return b;
+	msb = (b >> STATS_SUB_BITS) + STATS_SUB_BITS - 1;
+	return ((long)(STATS_SUB_BUCKETS + (b & (STATS_SUB_BUCKETS - 1)) + 1)
+		<< (msb - STATS_SUB_BITS)) - 1;
+}
+
+void
+stats_record(enum stats_stage stage, long ns)
+{
+	struct stats_slot *slot;
+
+	if (stats_slots == NULL)
+		return;
+	slot = &stats_slots[stats_slot];
+	__atomic_fetch_add(&slot->hist[stage][stats_bucket(ns < 0 ? 0 : ns)], 1,
+			   __ATOMIC_RELAXED);
+	__atomic_fetch_add(&slot->hist_sum[stage], ns, __ATOMIC_RELAXED);
+	/* the queue and total stages start at accept, on another thread, and
+	 * would overlap the spans of the worker, which traces its request
+	 * instead */
+	if (trace_enabled() && stage != STATS_STAGE_QUEUE &&
+	    stage != STATS_STAGE_TOTAL) {
+		long now = stats_now();
+
+		trace_span(stats_stage_names[stage], now - ns, now);
+	}
+}
+
+/* sums the histogram of a stage over all threads. Returns the count */
+static long
+stats_hist(enum stats_stage stage, long *hist, long *sum)
+{
+	long count = 0;
+	int i, j;
+
+	*sum = 0;
+	for (i = 0; i < STATS_BUCKETS; i++) {
+		hist[i] = 0;
+		for (j = 0; j < stats_nr_slots; j++) {
+			hist[i] += __atomic_load_n(&stats_slots[j].hist[stage][i],
+						   __ATOMIC_RELAXED);
+		}
+		count += hist[i];
+	}
+	for (j = 0; j < stats_nr_slots; j++) {
+		*sum += __atomic_load_n(&stats_slots[j].hist_sum[stage],
+					__ATOMIC_RELAXED);
+	}
+	return count;
+}
+
+/* the latency below which a fraction q of the count latencies fall, in ns */
+static long
+stats_quantile(long *hist, long count, double q)
+{
+	long rank = (long)(q * count + 0.5), seen = 0;
+	int i;
+
+	for (i = 0; i < STATS_BUCKETS; i++) {
+		seen += hist[i];
+		if (seen >= rank && seen > 0)
+			return stats_bucket_max(i);
+	}
+	return 0;
+}
+
+/* prints the latency of each stage, in us */
+void
+stats_dump(FILE *out)
+{
+	long hist[STATS_BUCKETS], count, sum;
+	char label[16];
+	int i, j;
+
+	if (stats_slots == NULL)
+		return;
+	fprintf(out, "%-8s %10s %10s", "stage", "count", "mean");
+	for (j = 0; j < STATS_NR_QUANTILES; j++) {
+		snprintf(label, sizeof(label), "p%g", stats_quantiles[j] * 100);
+		fprintf(out, " %9s", label);
+	}
+	fprintf(out, " %10s (us)\n", "max");
+	for (i = 0; i < STATS_NR_STAGES; i++) {
+		count = stats_hist(i, hist, &sum);
+		fprintf(out, "%-8s %10ld %10.1f", stats_stage_names[i], count,
+			count ? sum / 1000.0 / count : 0.0);
+		for (j = 0; j < STATS_NR_QUANTILES; j++) {
+			fprintf(out, " %9.1f", stats_quantile(hist, count,
+				stats_quantiles[j]) / 1000.0);
+		}
+		fprintf(out, " %10.1f\n",
+			stats_quantile(hist, count, 1.0) / 1000.0);
+	}
+}
+
+/* appends to buf, without going past max */
+#define STATS_PRINT(...)						\
+	do {								\
+		if (size < max)						\
+			size += snprintf(buf + size, max - size,	\
+					 __VA_ARGS__);			\
+	} while (0)
+
+/* formats the counters, summed over all threads, and the gauges into buf.
+ * Returns the size of the output, which is cut short at max bytes */
+int
+stats_format(char *buf, int max, int json, struct stats_gauge *gauges,
+	     int nr_gauges)
+{
+	long total[STATS_NR_COUNTERS];
+	long hist[STATS_BUCKETS], count, sum;
+	const struct stats_name *sn;
+	int size = 0;
+	int i, j;
+
+	for (i = 0; i < STATS_NR_COUNTERS; i++) {
+		total[i] = 0;
+		for (j = 0; j < stats_nr_slots; j++) {
+			total[i] += __atomic_load_n(&stats_slots[j].counter[i],
+						    __ATOMIC_RELAXED);
+		}
+	}
+	if (json) {
+		STATS_PRINT("{");
+		for (i = 0; i < STATS_NR_COUNTERS; i++) {
+			STATS_PRINT("%s\"%s\": %ld", i ? ", " : "",
+				    stats_names[i].key, total[i]);
+		}
+		for (i = 0; i < nr_gauges; i++) {
+			STATS_PRINT(", \"%s\": %ld", gauges[i].name,
+				    gauges[i].value);
+		}
+		STATS_PRINT(", \"stage_seconds\": {");
+		for (i = 0; i < STATS_NR_STAGES; i++) {
+			count = stats_hist(i, hist, &sum);
+			STATS_PRINT("%s\"%s\": {\"count\": %ld, \"sum\": %g",
+				    i ? ", " : "", stats_stage_names[i], count,
+				    sum / 1e9);
+			for (j = 0; j < STATS_NR_QUANTILES; j++) {
+				STATS_PRINT(", \"%g\": %g", stats_quantiles[j],
+					    stats_quantile(hist, count,
+						stats_quantiles[j]) / 1e9);
+			}
+			STATS_PRINT("}");
+		}
+		STATS_PRINT("}}\n");
+		return size < max ? size : max - 1;
+	}
+	for (i = 0; i < STATS_NR_COUNTERS; i++) {
+		sn = &stats_names[i];
+		if (sn->help) {
+			STATS_PRINT("# HELP " STATS_PREFIX "%s %s\n", sn->name,
+				    sn->help);
+			STATS_PRINT("# TYPE " STATS_PREFIX "%s counter\n",
+				    sn->name);
+		}
+		if (sn->label) {
+			STATS_PRINT(STATS_PREFIX "%s{code=\"%s\"} %ld\n",
+				    sn->name, sn->label, total[i]);
+		} else {
+			STATS_PRINT(STATS_PREFIX "%s %ld\n", sn->name,
+				    total[i]);
+		}
+	}
+	for (i = 0; i < nr_gauges; i++) {
+		STATS_PRINT("# HELP " STATS_PREFIX "%s %s\n", gauges[i].name,
+			    gauges[i].help);
+		STATS_PRINT("# TYPE " STATS_PREFIX "%s gauge\n",
+			    gauges[i].name);
+		STATS_PRINT(STATS_PREFIX "%s %ld\n", gauges[i].name,
+			    gauges[i].value);
+	}
+	STATS_PRINT("# HELP " STATS_PREFIX "stage_seconds "
+		    "Latency of each stage of a request.\n");
+	STATS_PRINT("# TYPE " STATS_PREFIX "stage_seconds summary\n");
+	for (i = 0; i < STATS_NR_STAGES; i++) {
+		count = stats_hist(i, hist, &sum);
+		for (j = 0; j < STATS_NR_QUANTILES; j++) {
+			STATS_PRINT(STATS_PREFIX "stage_seconds{stage=\"%s\","
+				    "quantile=\"%g\"} %g\n",
+				    stats_stage_names[i], stats_quantiles[j],
+				    stats_quantile(hist, count,
+						   stats_quantiles[j]) / 1e9);
+		}
+		STATS_PRINT(STATS_PREFIX "stage_seconds_sum{stage=\"%s\"} %g\n",
+			    stats_stage_names[i], sum / 1e9);
+		STATS_PRINT(STATS_PREFIX "stage_seconds_count{stage=\"%s\"} "
+			    "%ld\n", stats_stage_names[i], count);
+	}
+	return size < max ? size : max - 1;
+}
+
+void
+stats_exit(void)
+{
+	free(stats_slots);
+	stats_slots = NULL;
+	stats_nr_slots = 0;
+}
@@ -0,0 +1,64 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdio.h>
+
+/* the reserved names under which the metrics of the server are served */
+#define STATS_NAME "./__metrics"
+#define STATS_JSON_NAME "./__metrics.json"
+
+enum stats_counter {
+	STATS_REQUESTS,
+	STATS_RESPONSES_2XX,
+	STATS_RESPONSES_3XX,
+	STATS_RESPONSES_4XX,
+	STATS_RESPONSES_5XX,
+	STATS_BYTES_SENT,
+	STATS_HITS,
+	STATS_MISSES,
+	STATS_COLD_HITS,
+	STATS_SPILL_HITS,
+	STATS_BUNDLE_HITS,
+	STATS_DEDUP_HITS,
+	STATS_RECLAIM_WAITS,
+	STATS_ADMIT_REJECTS,
+	STATS_RESIZES,
+	STATS_STALE_HITS,
+	STATS_REFRESHES,
+	STATS_EVICTIONS,
+	STATS_COLD_EVICTIONS,
+	STATS_LOG_DROPS,
+	STATS_NR_COUNTERS
+};
+
+/* the stages of a request whose latency is recorded */
+enum stats_stage {
+	STATS_STAGE_QUEUE,	/* from accept until a worker picks it up */
+	STATS_STAGE_PARSE,	/* reading and parsing the request */
+	STATS_STAGE_READ,	/* getting the file into memory */
+	STATS_STAGE_PROCESS,	/* processing the file before it is sent */
+	STATS_STAGE_SEND,	/* writing the response */
+	STATS_STAGE_TOTAL,	/* from accept until the response is sent */
+	STATS_NR_STAGES
+};
+
+/* a value that the server samples when the metrics are requested */
+struct stats_gauge {
+	char *name;
+	char *help;
+	long value;
+};
+
+void stats_init(int nr_threads);
+void stats_thread(void);
+void stats_thread_exit(void);
+void stats_add(enum stats_counter counter, long n);
+void stats_request(int status, long bytes_sent);
+long stats_now(void);
+void stats_record(enum stats_stage stage, long ns);
+void stats_dump(FILE *out);
+int stats_format(char *buf, int max, int json, struct stats_gauge *gauges,
+		 int nr_gauges);
+void stats_exit(void);
+
+#endif /* __STATS_H__ */
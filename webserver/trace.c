@@ -0,0 +1,226 @@
+/*
+ * trace.c: Tracing of the server, for finding out where the time goes.
+ *
+ * When enabled, the stages of requests, waits for locks, evictions and idle
+ * workers are recorded as spans, with the times of stats_now(). Each thread
+ * keeps the last TRACE_EVENTS spans in a buffer of its own, so recording
+ * doesn't contend with other threads. trace_dump() writes the spans out in
+ * the Chrome trace-event format, which chrome://tracing and Perfetto show on
+ * a timeline, with a track per thread.
+ */
+
+#include "common.h"
+#include "stats.h"
+#include "trace.h"
+
+/* spans kept per thread, a power of two */
+#define TRACE_EVENTS 65536
+#define TRACE_NAME_MAX 32
+
+struct trace_event {
+	const char *name;	/* a string constant */
+	long start;
+	long end;
+};
+
+struct trace_buffer {
+	/* only held by the owner while recording, and by trace_dump, so it is
+	 * almost never contended */
+	pthread_mutex_t lock;
+	unsigned long head;	/* spans recorded so far */
+	int owned;		/* by a thread */
+	char name[TRACE_NAME_MAX];
+	struct trace_event *events;	/* NULL until the buffer is used */
+};
+
+static char *trace_path = NULL;
+static struct trace_buffer *trace_buffers = NULL;
+static int trace_nr_buffers = 0;
+static pthread_mutex_t trace_buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+/* the buffer of this thread, or -1 if it has none */
+static __thread int trace_buffer = -1;
+
+/* takes buffer i for the calling thread, shown under name */
+static void
+trace_take(int i, const char *name)
+{
+	struct trace_buffer *buffer = &trace_buffers[i];
+
+	buffer->owned = 1;
+	if (buffer->events == NULL) {
+		buffer->events = Malloc(sizeof(struct trace_event) *
+					TRACE_EVENTS);
+	}
+	snprintf(buffer->name, TRACE_NAME_MAX, "%s", name);
+	trace_buffer = i;
+}
+
+/* starts tracing into buffers for the calling, main, thread and up to
+ * max_threads workers, which is written to path. path is NULL when tracing
+ * is off */
+void
+trace_init(char *path, int max_threads)
+{
+	int i;
+
+	if (path == NULL)
+		return;
+	trace_path = path;
+	trace_nr_buffers = max_threads + 1;
+	trace_buffers = Malloc(sizeof(struct trace_buffer) * trace_nr_buffers);
+	for (i = 0; i < trace_nr_buffers; i++) {
+		pthread_mutex_init(&trace_buffers[i].lock, NULL);
+		trace_buffers[i].head = 0;
+		trace_buffers[i].owned = 0;
+		trace_buffers[i].events = NULL;
+	}
+	trace_take(0, "main");
+}
+
+/* gives the calling thread a buffer of its own, shown under name. a buffer
+ * that an exited thread used is reused, along with the spans in it */
+void
+trace_thread(const char *name)
+{
+	char buf[TRACE_NAME_MAX];
+	int i;
+
+	if (trace_buffers == NULL)
+		return;
+	pthread_mutex_lock(&trace_buffers_lock);
+	for (i = 1; i < trace_nr_buffers; i++) {
+		if (!trace_buffers[i].owned) {
+			snprintf(buf, sizeof(buf), "%s %d", name, i);
+			pthread_mutex_lock(&trace_buffers[i].lock);
+			trace_take(i, buf);
+			pthread_mutex_unlock(&trace_buffers[i].lock);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&trace_buffers_lock);
+}
+
+/* gives up the buffer of the calling thread, which is exiting */
+void
+trace_thread_exit(void)
+{
+	if (trace_buffers == NULL || trace_buffer < 0)
+		return;
+	pthread_mutex_lock(&trace_buffers_lock);
+	trace_buffers[trace_buffer].owned = 0;
+	pthread_mutex_unlock(&trace_buffers_lock);
+	trace_buffer = -1;
+}
+
+int
+trace_enabled(void)
+{
+	return trace_buffers != NULL;
+}
+
+/* Returns the start of a span, or 0 when tracing is off */
+long
+trace_start(void)
+{
+	return trace_buffers != NULL ? stats_now() : 0;
+}
+
+/* records a span of the calling thread, from start to end */
+void
+trace_span(const char *name, long start, long end)
+{
+	struct trace_buffer *buffer;
+	struct trace_event *event;
+
+	if (trace_buffers == NULL || trace_buffer < 0 || start == 0)
+		return;
+	buffer = &trace_buffers[trace_buffer];
+	pthread_mutex_lock(&buffer->lock);
+	event = &buffer->events[buffer->head & (TRACE_EVENTS - 1)];
+	event->name = name;
+	event->start = start;
+	event->end = end;
+	buffer->head++;
+	pthread_mutex_unlock(&buffer->lock);
+}
+
+/* writes the spans of buffer i to out, using events to hold a copy of
+ * them, so that the thread can go on while they are written.
+ * Returns the number of events written so far */
+static long
+trace_dump_buffer(FILE *out, int i, struct trace_event *events, long written)
+{
+	struct trace_buffer *buffer = &trace_buffers[i];
+	unsigned long first, head, j;
+	char name[TRACE_NAME_MAX];
+	int pid = getpid();
+
+	pthread_mutex_lock(&buffer->lock);
+	head = buffer->head;
+	memcpy(name, buffer->name, TRACE_NAME_MAX);
+	first = head > TRACE_EVENTS ? head - TRACE_EVENTS : 0;
+	if (head > 0) {
+		memcpy(events, buffer->events,
+		       sizeof(struct trace_event) * TRACE_EVENTS);
+	}
+	pthread_mutex_unlock(&buffer->lock);
+
+	if (head > 0) {
+		fprintf(out, "%s\n{\"ph\": \"M\", \"name\": \"thread_name\", "
+			"\"pid\": %d, \"tid\": %d, \"args\": {\"name\": "
+			"\"%s\"}}", written++ ? "," : "", pid, i, name);
+	}
+	for (j = first; j < head; j++) {
+		struct trace_event *event = &events[j & (TRACE_EVENTS - 1)];
+
+		fprintf(out, "%s\n{\"ph\": \"X\", \"name\": \"%s\", "
+			"\"pid\": %d, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+			written++ ? "," : "", event->name, pid, i,
+			event->start / 1e3, (event->end - event->start) / 1e3);
+	}
+	return written;
+}
+
+/* writes the spans that the threads have kept to the trace file, replacing
+ * an earlier dump */
+void
+trace_dump(void)
+{
+	struct trace_event *events;
+	FILE *out;
+	long written = 0;
+	int i;
+
+	if (trace_buffers == NULL)
+		return;
+	if ((out = fopen(trace_path, "w")) == NULL) {
+		fprintf(stderr, "trace: %s: %s\n", trace_path, strerror(errno));
+		return;
+	}
+	events = Malloc(sizeof(struct trace_event) * TRACE_EVENTS);
+	fprintf(out, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+	for (i = 0; i < trace_nr_buffers; i++) {
+		written = trace_dump_buffer(out, i, events, written);
+	}
+	fprintf(out, "\n]}\n");
+	fclose(out);
+	free(events);
+}
+
+/* writes the trace and stops tracing. the workers must have exited */
+void
+trace_exit(void)
+{
+	int i;
+
+	if (trace_buffers == NULL)
+		return;
+	trace_dump();
+	for (i = 0; i < trace_nr_buffers; i++) {
+		pthread_mutex_destroy(&trace_buffers[i].lock);
+		free(trace_buffers[i].events);
+	}
+	free(trace_buffers);
+	trace_buffers = NULL;
+	trace_nr_buffers = 0;
+}
@@ -0,0 +1,13 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+void trace_init(char *path, int max_threads);
+void trace_thread(const char *name);
+void trace_thread_exit(void);
+int trace_enabled(void);
+long trace_start(void);
+void trace_span(const char *name, long start, long end);
+void trace_dump(void);
+void trace_exit(void);
+
+#endif /* __TRACE_H__ */
@@ -0,0 +1,279 @@
+/*
+ * watch.c: Watches the document root with inotify, and reports files that are
+ * modified, removed or renamed, so that cached copies and metadata can be
+ * dropped as soon as they change instead of being revalidated with a stat on
+ * every request. The files the server writes itself, e.g., its access log,
+ * are not reported, see watch_ignore.
+ */
+
+#define _GNU_SOURCE	/* for nftw */
+#include <sys/inotify.h>
+#include <ftw.h>
+#include "common.h"
+#include "watch.h"
+
+#define WATCH_EVENTS (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | \
+		      IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+
+/* a watched directory */
+struct watch_dir {
+	int wd;		/* inotify watch descriptor */
+	char *path;	/* e.g., "./fileset_dir" */
+	struct watch_dir *next;
+};
+
+static int watch_fd = -1;
+static int watch_pipe[2];	/* written to when the watcher should exit */
+static pthread_t watch_thread;
+static int watch_running = 0;
+static struct watch_dir *watch_dirs = NULL;
+static void (*watch_changed)(char *file_name) = NULL;
+
+/* a file, or directory, under the root that the server writes itself */
+struct watch_ignored {
+	char *path;	/* e.g., "./logs/access.log" */
+	struct watch_ignored *next;
+};
+
+static struct watch_ignored *watch_ignored = NULL;
+
+/* ignores the changes to path, a file or directory that the server writes
+ * itself, which would otherwise be reported for every write. paths outside
+ * of the root don't need to be ignored. must be called before watch_init */
+void
+watch_ignore(char *path)
+{
+	char cwd[MAXLINE], dir[MAXLINE], real[MAXLINE], full[MAXLINE];
+	struct watch_ignored *ignored;
+	char *base;
+	int len;
+
+	if (path == NULL || getcwd(cwd, sizeof(cwd)) == NULL)
+		return;
+	/* the file may not exist yet, but its directory does */
+	snprintf(dir, sizeof(dir), "%s", path);
+	for (len = strlen(dir); len > 1 && dir[len - 1] == '/'; len--)
+		dir[len - 1] = '\0';
+	if ((base = strrchr(dir, '/')) != NULL) {
+		*base++ = '\0';
+		if (realpath(dir[0] ? dir : "/", real) == NULL)
+			return;
+	} else {
+		base = dir;
+		snprintf(real, sizeof(real), "%s", cwd);
+	}
+	snprintf(full, sizeof(full), "%s/%s", strcmp(real, "/") ? real : "",
+		 base);
+	/* named like watch_event names the files under the root */
+	len = strlen(cwd);
+	if (strncmp(full, cwd, len) != 0 || full[len] != '/')
+		return;
+	ignored = Malloc(sizeof(struct watch_ignored));
+	ignored->path = Malloc(strlen(full + len) + 2);
+	sprintf(ignored->path, ".%s", full + len);
+	ignored->next = watch_ignored;
+	watch_ignored = ignored;
+}
+
+/* Returns 1 if path is, or is below, a path that is ignored */
+static int
+watch_is_ignored(char *path)
+{
+	struct watch_ignored *ignored;
+	int len;
+
+	for (ignored = watch_ignored; ignored != NULL;
+	     ignored = ignored->next) {
+		len = strlen(ignored->path);
+		if (strncmp(path, ignored->path, len) == 0 &&
+		    (path[len] == '\0' || path[len] == '/'))
+			return 1;
+	}
+	return 0;
+}
+
+static void
+watch_add(const char *path)
+{
+	struct watch_dir *dir;
+	int wd;
+
+	if ((wd = inotify_add_watch(watch_fd, path, WATCH_EVENTS | IN_ONLYDIR))
+	    < 0) {
+		fprintf(stderr, "watch: %s: %s\n", path, strerror(errno));
+		return;
+	}
+	/* watching a directory twice returns the same descriptor */
+	for (dir = watch_dirs; dir != NULL; dir = dir->next) {
+		if (dir->wd == wd) {
+			return;
+		}
+	}
+	dir = Malloc(sizeof(struct watch_dir));
+	dir->wd = wd;
+	dir->path = Malloc(strlen(path) + 1);
+	strcpy(dir->path, path);
+	dir->next = watch_dirs;
+	watch_dirs = dir;
+}
+
+static int
+watch_add_tree(const char *path, const struct stat *sb, int type,
+	       struct FTW *ftwbuf)
+{
+	if (type == FTW_D) {
+		watch_add(path);
+	}
+	return 0;
+}
+
+static void
+watch_remove(int wd)
+{
+	struct watch_dir **prev = &watch_dirs;
+	struct watch_dir *dir;
+
+	while ((dir = *prev) != NULL) {
+		if (dir->wd == wd) {
+			*prev = dir->next;
+			free(dir->path);
+			free(dir);
+			return;
+		}
+		prev = &dir->next;
+	}
+}
+
+static void
+watch_event(struct inotify_event *ev)
+{
+	struct watch_dir *dir;
+	char path[MAXLINE];
+
+	if (ev->mask & IN_Q_OVERFLOW) {
+		/* events were lost, so anything may have changed */
+		watch_changed(NULL);
+		return;
+	}
+	if (ev->mask & IN_IGNORED) {
+		/* the directory was removed */
+		watch_remove(ev->wd);
+		return;
+	}
+	for (dir = watch_dirs; dir != NULL; dir = dir->next) {
+		if (dir->wd == ev->wd) {
+			break;
+		}
+	}
+	if (dir == NULL || ev->len == 0) {
+		return;
+	}
+	snprintf(path, sizeof(path), "%s/%s", dir->path, ev->name);
+	if (watch_is_ignored(path)) {
+		return;
+	}
+	if (ev->mask & IN_ISDIR) {
+		if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+			nftw(path, watch_add_tree, 16, FTW_PHYS);
+		}
+		/* every file below a renamed directory has a new name */
+		if (ev->mask & (IN_MOVED_FROM | IN_MOVED_TO)) {
+			watch_changed(NULL);
+		}
+		return;
+	}
+	watch_changed(path);
+}
+
+static void *
+watch_thread_start(void *arg)
+{
+	char buf[64 * 1024]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+	struct pollfd fds[] = {
+		{watch_fd, POLLIN},
+		{watch_pipe[0], POLLIN},
+	};
+	ssize_t n;
+	char *p;
+
+	while (1) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (fds[1].revents & POLLIN) { /* exit requested */
+			break;
+		}
+		if ((n = read(watch_fd, buf, sizeof(buf))) <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			break;
+		}
+		for (p = buf; p < buf + n;
+		     p += sizeof(struct inotify_event) +
+			     ((struct inotify_event *)p)->len) {
+			watch_event((struct inotify_event *)p);
+		}
+	}
+	return NULL;
+}
+
+/* starts watching every directory below root. changed is called from the
+ * watcher thread with the name of each file that changes, in the same form
+ * as the file names of requests (e.g., "./dir/file"), or with NULL when any
+ * file may have changed.
+ * Returns 1 if the root is being watched, 0 otherwise. */
+int
+watch_init(char *root, void (*changed)(char *file_name))
+{
+	if ((watch_fd = inotify_init1(IN_CLOEXEC)) < 0) {
+		perror("inotify_init1");
+		return 0;
+	}
+	SYS(pipe(watch_pipe));
+	watch_changed = changed;
+	nftw(root, watch_add_tree, 16, FTW_PHYS);
+	if (watch_dirs == NULL) {
+		watch_exit();
+		return 0;
+	}
+	SYS(pthread_create(&watch_thread, NULL, watch_thread_start, NULL));
+	watch_running = 1;
+	return 1;
+}
+
+/* stops the watcher thread, and closes the watches */
+static void
+watch_close(void)
+{
+	if (watch_running) {
+		/* wake up the watcher thread and wait for it */
+		Rio_write(watch_pipe[1], "x", 1);
+		pthread_join(watch_thread, NULL);
+		watch_running = 0;
+	}
+	while (watch_dirs != NULL) {
+		watch_remove(watch_dirs->wd);
+	}
+	SYS(close(watch_pipe[0]));
+	SYS(close(watch_pipe[1]));
+	SYS(close(watch_fd));
+	watch_fd = -1;
+}
+
+void
+watch_exit(void)
+{
+	struct watch_ignored *next;
+
+	if (watch_fd >= 0) {
+		watch_close();
+	}
+	for (; watch_ignored != NULL; watch_ignored = next) {
+		next = watch_ignored->next;
+		free(watch_ignored->path);
+		free(watch_ignored);
+	}
+}
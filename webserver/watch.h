@@ -0,0 +1,8 @@
+#ifndef __WATCH_H__
+#define __WATCH_H__
+
+void watch_ignore(char *path);
+int watch_init(char *root, void (*changed)(char *file_name));
+void watch_exit(void);
+
+#endif /* __WATCH_H__ */